@@ -20,19 +20,44 @@
 // 	OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
 // 	THE SOFTWARE.
 #include "smmalloc.h"
+#include <thread>
 
 namespace sm
 {
-struct CacheWarmupLink
-{
-    CacheWarmupLink* pNext;
-};
+// adaptive thread cache (see ALLOCATOR_ADAPTIVE_THREAD_CACHE)
+static const uint32_t kAdaptiveCacheMinCapacity = 16;
+static const uint32_t kAdaptiveCacheFlushesToShrink = 4;
+// bucket is considered idle if other buckets of the thread had this many refills and flushes since its last one
+static const uint32_t kAdaptiveCacheIdleTicks = 256;
+// thread cache stealing (see ALLOCATOR_CACHE_STEALING), smaller ranges are not worth publishing
+static const uint32_t kStealRangeMinCount = 8;
+// max number of elements a thread without a cache takes from a victim at once (extra elements go to the bucket)
+static const uint32_t kStealBatchCount = 64;
 
 namespace internal
 {
 
-void TlsPoolBucket::Init(uint32_t* pCacheStack, uint32_t maxElementsNum, CacheWarmupOptions warmupOptions, Allocator* alloc,
-                         size_t bucketIndex)
+// thread cache the bucket belongs to (buckets is the first member of ThreadCache)
+static SMM_INLINE ThreadCache* GetOwnerThreadCache(TlsPoolBucket* bucket, size_t bucketIndex)
+{
+    return (ThreadCache*)(bucket - bucketIndex);
+}
+
+void SpinLock::Lock()
+{
+    while (true)
+    {
+        uint32_t expected = 0;
+        if (locked.load(std::memory_order_relaxed) == 0 && locked.compare_exchange_weak(expected, 1, std::memory_order_acquire))
+        {
+            return;
+        }
+        std::this_thread::yield();
+    }
+}
+
+void TlsPoolBucket::Init(ElementOffset* pCacheStack, uint32_t maxElementsNum, uint32_t capacity, CacheWarmupOptions warmupOptions,
+                         Allocator* alloc, size_t bucketIndex)
 {
     // assume thread_local variable always initialized with zeroes
     SM_ASSERT(numElementsL0 == 0);
@@ -44,17 +69,19 @@ void TlsPoolBucket::Init(uint32_t* pCacheStack, uint32_t maxElementsNum, CacheWa
 
     Allocator::PoolBucket* poolBucket = alloc->GetBucketByIndex(bucketIndex);
 
+    SMMALLOC_USED_IN_ASSERT(maxElementsNum);
     SM_ASSERT(maxElementsNum >= SMM_MAX_CACHE_ITEMS_COUNT + 2);
+    SM_ASSERT(capacity > 0 && capacity <= (maxElementsNum - SMM_MAX_CACHE_ITEMS_COUNT));
     pStorageL1 = pCacheStack;
     numElementsL1 = 0;
     numElementsL0 = 0;
-    maxElementsCount = (maxElementsNum - SMM_MAX_CACHE_ITEMS_COUNT);
+    isFlushing = 0;
+    maxElementsCount = capacity;
     pBucket = poolBucket;
     SM_ASSERT(pBucket);
     pBucketData = pBucket->pData;
 
     // warmup cache
-    size_t elementSize = sm::GetBucketSizeInBytesByIndex(bucketIndex);
     if (warmupOptions == CACHE_COLD)
     {
         return;
@@ -62,62 +89,78 @@ void TlsPoolBucket::Init(uint32_t* pCacheStack, uint32_t maxElementsNum, CacheWa
 
     uint32_t num = (warmupOptions == CACHE_WARM) ? (maxElementsCount / 2) : (maxElementsCount);
 
-    CacheWarmupLink* pRoot = nullptr;
-
-    for (uint32_t j = 0; j < num; j++)
+    // take elements from global in chains (do not steal allocations from different buckets or from generic allocator)
+    while (numElementsL1 < num)
     {
-        // allocate from global (pThreadCache is still nullptr)
-        void* p = alloc->Allocate<false>(elementSize, Allocator::kDefaultTlsCacheAlignment);
-        if (p == nullptr)
+        uint32_t count = pBucket->AllocChain(num - numElementsL1, pStorageL1 + numElementsL1);
+        if (count == 0)
         {
             break;
         }
+        numElementsL1 += count;
+    }
+
+    SM_ASSERT(GetElementsCount() <= num);
+}
 
-        // do not steal allocations from different buckets or from generic allocator
-        if (alloc->GetBucketIndex(p) != (int32_t)bucketIndex)
+bool TlsPoolBucket::GetL1CacheFromMaster()
+{
+    SM_ASSERT(pBucket != nullptr);
+    SM_ASSERT(numElementsL0 == 0 && numElementsL1 == 0);
+    if (pBucket->useReturnChannels)
+    {
+        // elements freed by other threads are handed back in batches, take all of them (up to L1 capacity)
+        numElementsL1 = pBucket->AllocFromReturnChannel(maxElementsCount, pStorageL1);
+        if (numElementsL1 > 0)
         {
-            alloc->Free(p);
-            break;
+            return true;
         }
-
-        CacheWarmupLink* pItem = (CacheWarmupLink*)p;
-        pItem->pNext = pRoot;
-        pRoot = pItem;
     }
 
-    // move nodes to cache but passtrhough L0 cache
-    CacheWarmupLink* pCurrent = pRoot;
-    while (pCurrent)
+    uint32_t count = std::max(maxElementsCount / 2, uint32_t(1));
+    numElementsL1 = pBucket->AllocChain(count, pStorageL1);
+    return numElementsL1 > 0;
+}
+
+void TlsPoolBucket::Flush(uint32_t keepCount)
+{
+    if (keepCount == 0)
     {
-        CacheWarmupLink* pNext = pCurrent->pNext;
-        bool r = alloc->ReleaseToCache<false>(this, pCurrent);
-        SMMALLOC_USED_IN_ASSERT(r);
-        SM_ASSERT(r);
-        pCurrent = pNext;
+        // move cached allocations from L0 to L1 (we always has free space for L0 cache inside L1)
+        for (uint32_t i = 0; i < numElementsL0; i++)
+        {
+            pStorageL1[numElementsL1] = storageL0[i];
+            numElementsL1++;
+        }
+        numElementsL0 = 0;
     }
 
-    SM_ASSERT(GetElementsCount() == num);
+    if (numElementsL1 > keepCount)
+    {
+        ReturnL1CacheToMaster(numElementsL1 - keepCount);
+    }
 }
 
-uint32_t* TlsPoolBucket::Destroy()
+void TlsPoolBucket::FlushStep()
 {
-    // move cached allocations from L0 to L1 (we always has free space for L0 cache inside L1)
-    for (uint32_t i = 0; i < numElementsL0; i++)
+    uint32_t lowWatermark = (maxElementsCount >> 1);
+    if (numElementsL1 > lowWatermark)
     {
-        pStorageL1[numElementsL1] = storageL0[i];
-        numElementsL1++;
+        ReturnL1CacheToMaster(std::min(numElementsL1 - lowWatermark, uint32_t(SMM_INCREMENTAL_FLUSH_CHUNK)));
     }
+    isFlushing = (numElementsL1 > lowWatermark) ? 1 : 0;
+}
 
+ElementOffset* TlsPoolBucket::Destroy()
+{
     // return all cached elements to master
-    if (numElementsL1 > 0)
-    {
-        ReturnL1CacheToMaster(numElementsL1);
-    }
+    Flush(0);
 
-    uint32_t* r = pStorageL1;
+    ElementOffset* r = pStorageL1;
     pStorageL1 = nullptr;
     numElementsL0 = 0;
     numElementsL1 = 0;
+    isFlushing = 0;
     maxElementsCount = 0;
     pBucket = nullptr;
     pBucketData = nullptr;
@@ -127,151 +170,1278 @@ uint32_t* TlsPoolBucket::Destroy()
 } // namespace internal
 
 void Allocator::CreateThreadCache(CacheWarmupOptions warmupOptions, std::initializer_list<uint32_t> options)
+{
+    CreateThreadCache(warmupOptions, options.begin(), options.size());
+}
+
+void Allocator::CreateThreadCache(CacheWarmupOptions warmupOptions, const uint32_t* options, size_t optionsCount)
+{
+    // thread cache configuration is invalid
+    SM_ASSERT(bucketsCount >= optionsCount);
+
+    // all slots of the thread caches table are taken by other allocators
+    if (cacheId >= SMM_MAX_THREAD_CACHES_COUNT)
+    {
+        return;
+    }
+
+    // thread cache already exists
+    SM_ASSERT(internal::GetThreadCache(cacheId, cacheGeneration) == nullptr);
+    if (internal::GetThreadCache(cacheId, cacheGeneration) != nullptr)
+    {
+        return;
+    }
+
+    internal::ThreadCache* cache = AllocThreadCache(warmupOptions, options, optionsCount);
+    if (cache != nullptr)
+    {
+        // flush the cache on thread exit
+        internal::SetThreadCache(cacheId, cacheGeneration, cache);
+    }
+}
+
+void Allocator::DestroyThreadCache()
+{
+    internal::ThreadCache* cache = internal::GetThreadCache(cacheId, cacheGeneration);
+    if (cache == nullptr)
+    {
+        return;
+    }
+
+    internal::SetThreadCache(cacheId, cacheGeneration, nullptr);
+    FreeThreadCache(cache);
+}
+
+ThreadCache* Allocator::CreateCache(CacheWarmupOptions warmupOptions, std::initializer_list<uint32_t> options)
 {
     // thread cache configuration is invalid
     SM_ASSERT(bucketsCount >= options.size());
+    return AllocThreadCache(warmupOptions, options.begin(), options.size());
+}
 
-    size_t i = 0;
-    for (uint32_t _elementsNum : options)
+void Allocator::DestroyCache(ThreadCache* cache)
+{
+    if (cache == nullptr)
+    {
+        return;
+    }
+
+    SM_ASSERT(cache->owner == this);
+    FreeThreadCache(cache);
+}
+
+internal::ThreadCache* Allocator::AllocThreadCache(CacheWarmupOptions warmupOptions, const uint32_t* options, size_t optionsCount)
+{
+    internal::ThreadCache* cache =
+        (internal::ThreadCache*)GenericAllocator::Alloc(gAllocator, sizeof(internal::ThreadCache), SMM_CACHE_LINE_SIZE);
+    if (cache == nullptr)
+    {
+        return nullptr;
+    }
+    // value-initialization zeroes all members (atomics included)
+    new (cache) internal::ThreadCache();
+    cache->owner = this;
+    cache->budgetBytes = threadCacheBudget;
+    cache->scavengeEpoch = scavengeEpoch.load(std::memory_order_relaxed);
+
+    for (size_t i = 0; i < optionsCount; i++)
     {
         if (i >= bucketsCount)
         {
             break;
         }
 
-        uint32_t elementsNum = _elementsNum + SMM_MAX_CACHE_ITEMS_COUNT;
+        uint32_t elementsNum = options[i] + SMM_MAX_CACHE_ITEMS_COUNT;
+        uint32_t capacity = elementsNum - SMM_MAX_CACHE_ITEMS_COUNT;
+        if (flags & ALLOCATOR_ADAPTIVE_THREAD_CACHE)
+        {
+            // start small, hot buckets grow on refills
+            capacity = std::min(capacity, kAdaptiveCacheMinCapacity);
+        }
+        cache->feedback[i].capacityLimit = elementsNum - SMM_MAX_CACHE_ITEMS_COUNT;
+        cache->usedBytes += capacity * buckets[i].elementSize;
 
         // allocate stack for cache indices
-        uint32_t* localStack = (uint32_t*)GenericAllocator::Alloc(gAllocator, elementsNum * sizeof(uint32_t), SMM_CACHE_LINE_SIZE);
+        internal::ElementOffset* localStack = (internal::ElementOffset*)GenericAllocator::Alloc(
+            gAllocator, elementsNum * sizeof(internal::ElementOffset), SMM_CACHE_LINE_SIZE);
 
         // initialize
-        GetTlsBucket(i)->Init(localStack, elementsNum, warmupOptions, this, i);
+        cache->feedback[i].storageBase = localStack;
+        cache->buckets[i].Init(localStack, elementsNum, capacity, warmupOptions, this, i);
+    }
 
-        i++;
+    {
+        internal::SpinLockGuard lock(cacheListLock);
+        cache->listNext = cacheList;
+        if (cacheList != nullptr)
+        {
+            cacheList->listPrev = cache;
+        }
+        cacheList = cache;
     }
+    return cache;
 }
 
-void Allocator::DestroyThreadCache()
+void Allocator::FreeThreadCache(internal::ThreadCache* cache)
 {
+    {
+        // no thief can reach the cache after this point
+        internal::SpinLockGuard lock(cacheListLock);
+        if (cache->listPrev != nullptr)
+        {
+            cache->listPrev->listNext = cache->listNext;
+        }
+        else
+        {
+            cacheList = cache->listNext;
+        }
+        if (cache->listNext != nullptr)
+        {
+            cache->listNext->listPrev = cache->listPrev;
+        }
+    }
 
-    for (size_t i = 0; i < SMM_MAX_BUCKET_COUNT; i++)
+    for (size_t i = 0; i < bucketsCount; i++)
     {
-        uint32_t* p = GetTlsBucket(i)->Destroy();
+        ReclaimStealRange(cache, i);
+        internal::ElementOffset* p = cache->buckets[i].Destroy();
         GenericAllocator::Free(gAllocator, p);
     }
+
+    GenericAllocator::Free(gAllocator, cache);
+}
+
+size_t Allocator::GetThreadCacheCapacity(size_t bucketIndex) const
+{
+    internal::ThreadCache* cache = internal::GetThreadCache(cacheId, cacheGeneration);
+    if (cache == nullptr || bucketIndex >= bucketsCount)
+    {
+        return 0;
+    }
+    return cache->buckets[bucketIndex].maxElementsCount + cache->feedback[bucketIndex].publishedCount;
+}
+
+void Allocator::FlushThreadCache()
+{
+    internal::ThreadCache* cache = internal::GetThreadCache(cacheId, cacheGeneration);
+    if (cache == nullptr)
+    {
+        return;
+    }
+
+    for (size_t i = 0; i < bucketsCount; i++)
+    {
+        ReclaimStealRange(cache, i);
+        cache->buckets[i].Flush(0);
+    }
 }
 
-void Allocator::PoolBucket::Create(size_t elementSize)
+void Allocator::Scavenge()
 {
-    SM_ASSERT(elementSize >= 16 && "Invalid element size");
+    scavengeEpoch.fetch_add(1, std::memory_order_relaxed);
 
-    // build inplace single linked list
-    globalTag.store(0, std::memory_order_relaxed);
-    uint8_t* node = pData;
+    // the calling thread doesn't have to wait for its next slow path
+    internal::ThreadCache* cache = internal::GetThreadCache(cacheId, cacheGeneration);
+    if (cache != nullptr)
+    {
+        CheckScavengeEpoch(cache);
+    }
+}
 
-    TaggedIndex headVal;
-    headVal.p.tag = globalTag.load(std::memory_order_relaxed);
-    headVal.p.offset = (uint32_t)(node - pData);
-    head.store(headVal.u);
+void Allocator::CheckScavengeEpoch(internal::ThreadCache* cache)
+{
+    uint32_t epoch = scavengeEpoch.load(std::memory_order_relaxed);
+    if (cache->scavengeEpoch == epoch)
+    {
+        return;
+    }
+    cache->scavengeEpoch = epoch;
 
-    while (true)
+    for (size_t i = 0; i < bucketsCount; i++)
+    {
+        internal::TlsPoolBucket& bucket = cache->buckets[i];
+        if (bucket.maxElementsCount != 0)
+        {
+            ReclaimStealRange(cache, i);
+            bucket.Flush(scavengeWatermark);
+        }
+    }
+}
+
+void Allocator::OnThreadCacheMiss(internal::TlsPoolBucket* _self)
+{
+    size_t bucketIndex = size_t(_self->pBucket - buckets.data());
+    internal::ThreadCache* cache = internal::GetOwnerThreadCache(_self, bucketIndex);
+    ReclaimStealRange(cache, bucketIndex);
+    CheckScavengeEpoch(cache);
+    if ((flags & ALLOCATOR_ADAPTIVE_THREAD_CACHE) == 0)
+    {
+        return;
+    }
+
+    internal::ThreadCacheFeedback& feedback = cache->feedback[bucketIndex];
+    feedback.lastActivity = ++cache->clock;
+    feedback.flushStreak = 0;
+
+    // cache ran dry, double the capacity
+    uint32_t capacity = std::min(_self->maxElementsCount * 2, feedback.capacityLimit);
+    if (capacity > _self->maxElementsCount)
+    {
+        ResizeThreadCache(cache, bucketIndex, capacity);
+    }
+}
+
+void Allocator::OnThreadCacheOverflow(internal::TlsPoolBucket* _self)
+{
+    size_t bucketIndex = size_t(_self->pBucket - buckets.data());
+    internal::ThreadCache* cache = internal::GetOwnerThreadCache(_self, bucketIndex);
+    ReclaimStealRange(cache, bucketIndex);
+    CheckScavengeEpoch(cache);
+    if (flags & ALLOCATOR_ADAPTIVE_THREAD_CACHE)
+    {
+        internal::ThreadCacheFeedback& feedback = cache->feedback[bucketIndex];
+        feedback.lastActivity = ++cache->clock;
+
+        // thread keeps freeing more than it allocates, halve the capacity (a refill in between resets the streak)
+        feedback.flushStreak++;
+        if (feedback.flushStreak >= kAdaptiveCacheFlushesToShrink)
+        {
+            feedback.flushStreak = 0;
+            uint32_t capacity = std::max(_self->maxElementsCount / 2, std::min(kAdaptiveCacheMinCapacity, feedback.capacityLimit));
+            if (capacity < _self->maxElementsCount)
+            {
+                ResizeThreadCache(cache, bucketIndex, capacity);
+            }
+        }
+    }
+
+    if (_self->numElementsL1 >= _self->maxElementsCount)
     {
-        uint8_t* next = node + elementSize;
-        if ((next + elementSize) <= pBufferEnd)
+        if (flags & ALLOCATOR_INCREMENTAL_FLUSH)
         {
-            TaggedIndex nextVal;
-            nextVal.p.tag = globalTag.load(std::memory_order_relaxed);
-            nextVal.p.offset = (uint32_t)(next - pData);
-            *((TaggedIndex*)(node)) = nextVal;
+            // return the first chunk now, the next frees keep returning chunks until the cache is down to half
+            _self->FlushStep();
         }
         else
         {
-            // last node
-            ((TaggedIndex*)(node))->u = TaggedIndex::Invalid;
-            break;
+            uint32_t halfOfElements = (_self->numElementsL1 >> 1);
+            _self->ReturnL1CacheToMaster(halfOfElements);
         }
+    }
 
-        node = next;
-        globalTag.fetch_add(1, std::memory_order_relaxed);
+    if (flags & ALLOCATOR_CACHE_STEALING)
+    {
+        PublishStealRange(cache, bucketIndex);
     }
 }
 
-Allocator::Allocator(GenericAllocator::TInstance allocator)
-    : bucketsCount(0)
-    , bucketSizeInBytes(0)
-    , pBufferEnd(nullptr)
-    , pBuffer(nullptr, GenericAllocator::Deleter(allocator))
-    , gAllocator(allocator)
+void Allocator::PublishStealRange(internal::ThreadCache* cache, size_t bucketIndex)
 {
+    internal::TlsPoolBucket& bucket = cache->buckets[bucketIndex];
+    internal::ThreadCacheFeedback& feedback = cache->feedback[bucketIndex];
+    SM_ASSERT(feedback.publishedCount == 0);
+    // cache can be above its capacity after a shrink (see ALLOCATOR_INCREMENTAL_FLUSH)
+    uint32_t count = std::min(bucket.numElementsL1, bucket.maxElementsCount) / 2;
+    if (count < kStealRangeMinCount)
+    {
+        return;
+    }
+
+    // bottom of the L1 stack becomes the stealable range, the owner works with the rest
+    feedback.publishedCount = count;
+    bucket.pStorageL1 += count;
+    bucket.numElementsL1 -= count;
+    bucket.maxElementsCount -= count;
+
+    uint64_t version = (feedback.stealRange.load(std::memory_order_relaxed) >> 32) + 1;
+    feedback.stealRange.store((version << 32) | count, std::memory_order_release);
 }
 
-// Return the next power of 2 higher than the input
-// If the input is already a power of 2, the output will be the same as the input.
-// Got this from Brian Sharp's SWEng mailing list.
-SMM_INLINE int GetNextPow2(uint32_t n)
+void Allocator::ReclaimStealRange(internal::ThreadCache* cache, size_t bucketIndex)
 {
-    n -= 1;
+    internal::ThreadCacheFeedback& feedback = cache->feedback[bucketIndex];
+    if (feedback.publishedCount == 0)
+    {
+        return;
+    }
 
-    n |= n >> 16;
-    n |= n >> 8;
-    n |= n >> 4;
-    n |= n >> 2;
-    n |= n >> 1;
+    // close the range, thieves that loaded it before fail their CAS because of the new version
+    uint64_t range = feedback.stealRange.load(std::memory_order_relaxed);
+    while (!feedback.stealRange.compare_exchange_weak(range, ((range >> 32) + 1) << 32, std::memory_order_acquire,
+                                                      std::memory_order_relaxed))
+    {
+    }
 
-    return n + 1;
+    // elements that were not stolen are still at the bottom of the storage, move the owner's elements right after them
+    internal::TlsPoolBucket& bucket = cache->buckets[bucketIndex];
+    uint32_t leftCount = uint32_t(range);
+    SM_ASSERT(leftCount <= feedback.publishedCount);
+    if (leftCount != feedback.publishedCount && bucket.numElementsL1 > 0)
+    {
+        std::memmove(feedback.storageBase + leftCount, bucket.pStorageL1, bucket.numElementsL1 * sizeof(internal::ElementOffset));
+    }
+    bucket.pStorageL1 = feedback.storageBase;
+    bucket.numElementsL1 += leftCount;
+    bucket.maxElementsCount += feedback.publishedCount;
+    feedback.publishedCount = 0;
 }
 
-void Allocator::Init(uint32_t _bucketsCount, size_t _bucketSizeInBytes)
+void* Allocator::StealFromThreadCaches(size_t bucketIndex, internal::ThreadCache* self)
 {
-    /*
-    for (size_t bucketIdx = 0; bucketIdx < 64; bucketIdx++)
+    // stolen elements go to the L1 of the current thread (it is empty, the thread wouldn't be here otherwise)
+    if (self == nullptr)
     {
-        printf("%zu->%zu, ", bucketIdx, sm::getBucketSizeInBytesByIndex(bucketIdx));
+        self = internal::GetThreadCache(cacheId, cacheGeneration);
     }
-    */
+    internal::TlsPoolBucket* tlsBucket = (self != nullptr) ? &self->buckets[bucketIndex] : nullptr;
+    uint32_t room = (tlsBucket != nullptr) ? (tlsBucket->maxElementsCount - tlsBucket->numElementsL1) : 0;
 
-    if (bucketsCount > 0)
+    std::array<internal::ElementOffset, kStealBatchCount> batch;
+    internal::ElementOffset* pBatch = (room != 0) ? (tlsBucket->pStorageL1 + tlsBucket->numElementsL1) : batch.data();
+    uint32_t maxCount = (room != 0) ? room : kStealBatchCount;
+
+    internal::SpinLockGuard lock(cacheListLock);
+    for (internal::ThreadCache* victim = cacheList; victim != nullptr; victim = victim->listNext)
     {
-        // already initialized
+        if (victim == self)
+        {
+            continue;
+        }
+
+        internal::ThreadCacheFeedback& feedback = victim->feedback[bucketIndex];
+        uint64_t range = feedback.stealRange.load(std::memory_order_acquire);
+        while (uint32_t(range) != 0)
+        {
+            // take the top half of the range
+            uint32_t count = uint32_t(range);
+            uint32_t takeCount = std::min((count + 1) / 2, maxCount);
+            std::memcpy(pBatch, feedback.storageBase + (count - takeCount), takeCount * sizeof(internal::ElementOffset));
+            if (!feedback.stealRange.compare_exchange_weak(range, range - takeCount, std::memory_order_acq_rel,
+                                                          std::memory_order_acquire))
+            {
+                // the owner took the range back (or another thief was faster), copied values might be stale
+                continue;
+            }
+
+#ifdef SMMALLOC_STATS_SUPPORT
+            buckets[bucketIndex].bucketStats.stealCount.fetch_add(takeCount, std::memory_order_relaxed);
+#endif
+            PoolBucket& bucket = buckets[bucketIndex];
+            if (room != 0)
+            {
+                tlsBucket->numElementsL1 += takeCount - 1;
+                return bucket.pData + tlsBucket->pStorageL1[tlsBucket->numElementsL1];
+            }
+
+            // no thread cache, the rest goes back to the bucket
+            std::sort(pBatch + 1, pBatch + takeCount);
+            bucket.FreeSortedOffsets(pBatch + 1, takeCount - 1);
+            return bucket.pData + pBatch[0];
+        }
+    }
+    return nullptr;
+}
+
+bool Allocator::ResizeThreadCache(internal::ThreadCache* cache, size_t bucketIndex, uint32_t capacity)
+{
+    // capacity of the idle buckets can change, they might have a stealable range
+    ReclaimStealRange(cache, bucketIndex);
+    internal::TlsPoolBucket& bucket = cache->buckets[bucketIndex];
+    size_t elementSize = buckets[bucketIndex].elementSize;
+    if (capacity > bucket.maxElementsCount)
+    {
+        size_t extraBytes = (capacity - bucket.maxElementsCount) * elementSize;
+        if (cache->usedBytes + extraBytes > cache->budgetBytes)
+        {
+            // out of budget, take capacity from the buckets that were idle for a while
+            for (size_t i = 0; i < bucketsCount; i++)
+            {
+                internal::TlsPoolBucket& other = cache->buckets[i];
+                internal::ThreadCacheFeedback& feedback = cache->feedback[i];
+                uint32_t minCapacity = std::min(kAdaptiveCacheMinCapacity, feedback.capacityLimit);
+                if (i != bucketIndex && other.maxElementsCount > minCapacity && (cache->clock - feedback.lastActivity) > kAdaptiveCacheIdleTicks)
+                {
+                    ResizeThreadCache(cache, i, std::max(other.maxElementsCount / 2, minCapacity));
+                }
+            }
+
+            if (cache->usedBytes + extraBytes > cache->budgetBytes)
+            {
+                // grow as much as the budget allows
+                size_t budgetLeft = (cache->budgetBytes > cache->usedBytes) ? (cache->budgetBytes - cache->usedBytes) : 0;
+                capacity = bucket.maxElementsCount + uint32_t(Min(budgetLeft / elementSize, size_t(capacity - bucket.maxElementsCount)));
+                if (capacity == bucket.maxElementsCount)
+                {
+                    return false;
+                }
+            }
+        }
+
+        cache->usedBytes += (capacity - bucket.maxElementsCount) * elementSize;
+#ifdef SMMALLOC_STATS_SUPPORT
+        buckets[bucketIndex].bucketStats.cacheGrowCount.fetch_add(1, std::memory_order_relaxed);
+#endif
+    }
+    else
+    {
+        // give extra elements back (L0 is not limited by capacity, incremental flush leaves the rest to the next overflows)
+        if (bucket.numElementsL1 > capacity)
+        {
+            bucket.ReturnL1CacheToMaster(BoundFlushCount(bucket.numElementsL1 - capacity));
+        }
+
+        cache->usedBytes -= (bucket.maxElementsCount - capacity) * elementSize;
+#ifdef SMMALLOC_STATS_SUPPORT
+        buckets[bucketIndex].bucketStats.cacheShrinkCount.fetch_add(1, std::memory_order_relaxed);
+#endif
+    }
+
+    bucket.maxElementsCount = capacity;
+    return true;
+}
+
+void Allocator::SetAutoThreadCache(CacheWarmupOptions warmupOptions, std::initializer_list<uint32_t> options)
+{
+    SM_ASSERT(bucketsCount >= options.size());
+    autoCacheOptionsCount = 0;
+    for (uint32_t elementsNum : options)
+    {
+        if (autoCacheOptionsCount >= bucketsCount)
+        {
+            break;
+        }
+        autoCacheOptions[autoCacheOptionsCount++] = elementsNum;
+    }
+    autoCacheWarmup = warmupOptions;
+}
+
+bool Allocator::CreateAutoThreadCache()
+{
+    // thread already has a cache (some buckets might be not cached by the profile) or allocator can't have thread caches
+    if (cacheId >= SMM_MAX_THREAD_CACHES_COUNT || internal::GetThreadCache(cacheId, cacheGeneration) != nullptr)
+    {
+        return false;
+    }
+
+    CreateThreadCache(autoCacheWarmup, autoCacheOptions.data(), autoCacheOptionsCount);
+    return true;
+}
+
+void Allocator::PoolBucket::Create(size_t _elementSize, size_t capacityInBytes, size_t _pageSize, uint32_t flags)
+{
+    SM_ASSERT(_elementSize >= 16 && "Invalid element size");
+    SM_ASSERT(capacityInBytes <= size_t(pBufferEnd - pData));
+    elementSize = _elementSize;
+    shardsMask = (flags & ALLOCATOR_SHARDED_BUCKETS) ? (SMM_BUCKET_SHARDS_COUNT - 1) : 0;
+    useReturnChannels = (flags & ALLOCATOR_RETURN_CHANNELS) != 0;
+    hungryShardIndex.store(kNoHungryShard, std::memory_order_relaxed);
+    for (Shard& shard : shards)
+    {
+        shard.globalTag.store(0, std::memory_order_relaxed);
+        shard.Store(TaggedIndex::MakeInvalid());
+        shard.returnHead.store(TaggedIndex::kInvalidOffset, std::memory_order_relaxed);
+    }
+    frontier.store(0, std::memory_order_relaxed);
+    capacity.store(capacityInBytes, std::memory_order_relaxed);
+    segmentSize = (flags & ALLOCATOR_GROWABLE_BUCKETS) ? capacityInBytes : 0;
+    pageSize = _pageSize;
+    committedBytes.store((pageSize != 0) ? 0 : size_t(pBufferEnd - pData), std::memory_order_relaxed);
+
+    if ((flags & ALLOCATOR_EAGER_INIT) == 0)
+    {
+        // elements are taken from the frontier on demand, untouched memory is never written
         return;
     }
-    SM_ASSERT(_bucketsCount > 0 && _bucketsCount <= SMM_MAX_BUCKET_COUNT);
 
-    if (_bucketsCount == 0)
+    if (!CommitUpTo(capacityInBytes))
     {
         return;
     }
 
-    if (_bucketsCount >= SMM_MAX_BUCKET_COUNT)
+    // build inplace single linked lists (every shard gets its own range of the bucket)
+    size_t elementsCount = capacityInBytes / elementSize;
+    size_t shardsCount = size_t(shardsMask) + 1;
+    size_t shardElementsCount = elementsCount / shardsCount;
+    for (size_t i = 0; i < shardsCount; i++)
     {
-        _bucketsCount = SMM_MAX_BUCKET_COUNT;
+        size_t begin = i * shardElementsCount;
+        size_t count = (i + 1 < shardsCount) ? shardElementsCount : (elementsCount - begin);
+        FreeRun(shards[i], internal::ElementOffset(begin * elementSize), count);
     }
 
-    bucketsCount = _bucketsCount;
-    size_t alignmentMax = kMaxValidAlignment;
-    bucketSizeInBytes = Align(_bucketSizeInBytes, kMaxValidAlignment);
+    // all elements are in the free list now
+    frontier.store(elementsCount * elementSize, std::memory_order_relaxed);
+}
 
-    size_t i = 0;
-    for (i = 0; i < bucketsDataBegin.size(); i++)
+bool Allocator::PoolBucket::CommitUpTo(size_t bytesCount)
+{
+    const size_t kCommitChunkSize = 64 * 1024;
+    size_t bucketBytes = size_t(pBufferEnd - pData);
+    SM_ASSERT(bytesCount <= bucketBytes);
+
+    internal::SpinLockGuard lock(commitLock);
+
+    // another thread might commit this range while we were waiting for the lock
+    size_t committed = committedBytes.load(std::memory_order_relaxed);
+    if (committed >= bytesCount)
     {
-        bucketsDataBegin[i] = nullptr;
+        return true;
     }
 
-    size_t totalBytesCount = bucketSizeInBytes * bucketsCount;
-    pBuffer.reset((uint8_t*)GenericAllocator::Alloc(gAllocator, totalBytesCount, alignmentMax));
-    pBufferEnd = pBuffer.get() + totalBytesCount + 1;
+    SM_ASSERT(pageSize != 0);
+    size_t chunkSize = std::max(kCommitChunkSize, pageSize);
+    size_t newCommitted = Min(Align(std::max(bytesCount, committed + chunkSize), pageSize), bucketBytes);
+    if (!VirtualMemory::Commit(pData + committed, newCommitted - committed))
+    {
+        return false;
+    }
+
+    committedBytes.store(newCommitted, std::memory_order_release);
+    return true;
+}
 
-    for (i = 0; i < bucketsCount; i++)
+bool Allocator::PoolBucket::Grow(size_t bytesCount)
+{
+    size_t bucketBytes = size_t(pBufferEnd - pData);
+
+    internal::SpinLockGuard lock(commitLock);
+
+    // another thread might grow the bucket while we were waiting for the lock
+    size_t currentCapacity = capacity.load(std::memory_order_relaxed);
+    if (currentCapacity >= bytesCount)
     {
-        PoolBucket& bucket = buckets[i];
-        bucket.pData = pBuffer.get() + i * bucketSizeInBytes;
-        bucket.pBufferEnd = bucket.pData + bucketSizeInBytes;
-        size_t bucketSizeInBytes = GetBucketSizeInBytesByIndex(i);
-        SM_ASSERT(IsAligned(bucketSizeInBytes, kMinValidAlignment));
-        SM_ASSERT(IsAligned(size_t(bucket.pData), alignmentMax) && "Incorrect alignment detected!");
-        bucket.Create(bucketSizeInBytes);
-        bucketsDataBegin[i] = bucket.pData;
+        return true;
+    }
+
+    // the whole reserved range is already in use
+    size_t newCapacity = Min(currentCapacity + segmentSize, bucketBytes);
+    if (newCapacity < bytesCount)
+    {
+        return false;
+    }
+
+    capacity.store(newCapacity, std::memory_order_relaxed);
+#ifdef SMMALLOC_STATS_SUPPORT
+    bucketStats.growCount.fetch_add(1, std::memory_order_relaxed);
+#endif
+    return true;
+}
+
+void Allocator::PoolBucket::FreeSortedOffsets(const internal::ElementOffset* offsets, size_t count)
+{
+    if (count == 0)
+    {
+        return;
+    }
+
+    // reserve unique tags for the inner nodes
+    Shard& shard = shards[GetHomeShardIndex()];
+    internal::ElementOffset tag = shard.globalTag.fetch_add(internal::ElementOffset(count), std::memory_order_relaxed);
+    for (size_t i = 0; i + 1 < count; i++)
+    {
+        TaggedIndex nextVal;
+        nextVal.p.tag = tag + internal::ElementOffset(i);
+        nextVal.p.offset = offsets[i + 1];
+        *((TaggedIndex*)(pData + offsets[i])) = nextVal;
+    }
+
+    FreeInterval(shard, pData + offsets[0], pData + offsets[count - 1]);
+}
+
+uint32_t Allocator::PoolBucket::AllocChain(uint32_t maxCount, internal::ElementOffset* offsets)
+{
+    SM_ASSERT(maxCount > 0);
+    while (true)
+    {
+        uint32_t listsEpoch = trimEpoch.load(std::memory_order_acquire);
+
+        // home shard first, then steal from the neighbour shards
+        uint32_t homeShardIndex = GetHomeShardIndex();
+        for (uint32_t i = 0; i <= shardsMask; i++)
+        {
+            uint32_t count = AllocChainFromShard(shards[(homeShardIndex + i) & shardsMask], maxCount, offsets);
+            if (count > 0)
+            {
+                return count;
+            }
+        }
+
+        // all lists are empty, pick up elements returned to the threads that no longer ask for them
+        if (useReturnChannels && DrainReturnChannels())
+        {
+            continue;
+        }
+
+        // reuse trimmed elements first
+        if (releasedRunsCount.load(std::memory_order_acquire) != 0 && RearmReleasedRun())
+        {
+            continue;
+        }
+
+        // take never used elements
+        size_t offset = 0;
+        uint32_t count = AllocFromFrontier(maxCount, offset, listsEpoch);
+        if (count == 0 && WaitForTrim(listsEpoch))
+        {
+            continue;
+        }
+
+        for (uint32_t i = 0; i < count; i++)
+        {
+            offsets[i] = internal::ElementOffset(offset + i * elementSize);
+        }
+        return count;
+    }
+}
+
+size_t Allocator::PoolBucket::AllocBatch(size_t count, void** out)
+{
+    const uint32_t kMaxChainLength = 64;
+    std::array<internal::ElementOffset, kMaxChainLength> offsets;
+    size_t doneCount = 0;
+    while (doneCount < count)
+    {
+        uint32_t chainLength = AllocChain(uint32_t(std::min(count - doneCount, size_t(kMaxChainLength))), offsets.data());
+        if (chainLength == 0)
+        {
+            break;
+        }
+
+        for (uint32_t i = 0; i < chainLength; i++)
+        {
+            out[doneCount++] = pData + offsets[i];
+        }
+    }
+    return doneCount;
+}
+
+uint32_t Allocator::PoolBucket::AllocChainFromShard(Shard& shard, uint32_t maxCount, internal::ElementOffset* offsets)
+{
+    TaggedIndex headValue = shard.Load();
+    while (true)
+    {
+        if (!headValue.IsValid())
+        {
+            return 0;
+        }
+
+        // Walk the list without owning it. Elements can be taken (and overwritten) by other threads meanwhile, but then the head
+        // is changed as well and CAS below fails. Offsets read from overwritten elements are only checked to stay inside of the
+        // committed part of the bucket (the frontier is published after the commit, so every element ever used is committed).
+        // The check must not overflow, user data can look like an offset close to the maximum value.
+        size_t committed = committedBytes.load(std::memory_order_acquire);
+        uint32_t walkLength = std::min(maxCount, uint32_t(kMaxChainWalkLength));
+        bool isListChanged = false;
+        uint32_t count = 0;
+        TaggedIndex it = headValue;
+        while (count < walkLength && it.IsValid())
+        {
+            if (size_t(it.p.offset) >= committed || committed - size_t(it.p.offset) < elementSize)
+            {
+                isListChanged = true;
+                break;
+            }
+
+            offsets[count++] = it.p.offset;
+            it = *((TaggedIndex*)(pData + it.p.offset));
+        }
+
+        if (isListChanged)
+        {
+            headValue = shard.Load();
+            continue;
+        }
+
+        // detach the whole chain (head -> ... -> offsets[count-1])
+        if (shard.CompareExchange(headValue, it))
+        {
+            return count;
+        }
+        // can't swap values, head is changed (now headValue has new head loaded) try again
+    }
+}
+
+uint32_t Allocator::PoolBucket::AllocFromReturnChannel(uint32_t maxCount, internal::ElementOffset* offsets)
+{
+    SM_ASSERT(useReturnChannels && maxCount > 0);
+    uint32_t homeShardIndex = GetHomeShardIndex();
+    Shard& shard = shards[homeShardIndex];
+
+    // ask other threads to flush their caches to our shard (the store is skipped if it is already ours to keep the line shared)
+    if (hungryShardIndex.load(std::memory_order_relaxed) != homeShardIndex)
+    {
+        hungryShardIndex.store(homeShardIndex, std::memory_order_relaxed);
+    }
+
+    if (shard.returnHead.load(std::memory_order_relaxed) == TaggedIndex::kInvalidOffset)
+    {
+        return 0;
+    }
+
+    // take all, nobody else can touch the detached chain
+    internal::ElementOffset it = shard.returnHead.exchange(TaggedIndex::kInvalidOffset, std::memory_order_acquire);
+    uint32_t count = 0;
+    while (count < maxCount && it != TaggedIndex::kInvalidOffset)
+    {
+        offsets[count++] = it;
+        it = ((TaggedIndex*)(pData + it))->p.offset;
+    }
+
+    if (it != TaggedIndex::kInvalidOffset)
+    {
+        // more than we can cache, give the rest back for the next miss
+        uint8_t* pTail = pData + it;
+        for (internal::ElementOffset next = ((TaggedIndex*)pTail)->p.offset; next != TaggedIndex::kInvalidOffset;
+             next = ((TaggedIndex*)pTail)->p.offset)
+        {
+            pTail = pData + next;
+        }
+        PushReturnChain(shard, pData + it, pTail);
+    }
+
+#ifdef SMMALLOC_STATS_SUPPORT
+    bucketStats.returnChannelHitCount.fetch_add(1, std::memory_order_relaxed);
+#endif
+    return count;
+}
+
+bool Allocator::PoolBucket::DrainReturnChannels()
+{
+    bool isDrained = false;
+    for (uint32_t i = 0; i <= shardsMask; i++)
+    {
+        Shard& shard = shards[i];
+        if (shard.returnHead.load(std::memory_order_relaxed) == TaggedIndex::kInvalidOffset)
+        {
+            continue;
+        }
+
+        internal::ElementOffset head = shard.returnHead.exchange(TaggedIndex::kInvalidOffset, std::memory_order_acquire);
+        if (head == TaggedIndex::kInvalidOffset)
+        {
+            continue;
+        }
+
+        uint8_t* pTail = pData + head;
+        for (internal::ElementOffset next = ((TaggedIndex*)pTail)->p.offset; next != TaggedIndex::kInvalidOffset;
+             next = ((TaggedIndex*)pTail)->p.offset)
+        {
+            pTail = pData + next;
+        }
+
+        // tags of the inner nodes are reused as is (same as for the chains flushed by thread caches)
+        FreeInterval(shard, pData + head, pTail);
+        isDrained = true;
+    }
+    return isDrained;
+}
+
+void Allocator::PoolBucket::FreeRun(Shard& shard, internal::ElementOffset begin, size_t elementsCount)
+{
+    if (elementsCount == 0)
+    {
+        return;
+    }
+
+    // reserve unique tags for the inner nodes
+    internal::ElementOffset tag = shard.globalTag.fetch_add(internal::ElementOffset(elementsCount), std::memory_order_relaxed);
+    internal::ElementOffset offset = begin;
+    for (size_t i = 0; i + 1 < elementsCount; i++)
+    {
+        TaggedIndex nextVal;
+        nextVal.p.tag = tag + internal::ElementOffset(i);
+        nextVal.p.offset = offset + internal::ElementOffset(elementSize);
+        *((TaggedIndex*)(pData + offset)) = nextVal;
+        offset = nextVal.p.offset;
+    }
+
+    FreeInterval(shard, pData + begin, pData + offset);
+}
+
+bool Allocator::PoolBucket::AddReleasedRun(GenericAllocator::TInstance allocator, internal::ElementOffset begin, internal::ElementOffset end)
+{
+    internal::SpinLockGuard lock(commitLock);
+
+    uint32_t count = releasedRunsCount.load(std::memory_order_relaxed);
+    if (count == releasedRunsCapacity)
+    {
+        uint32_t newCapacity = std::max(releasedRunsCapacity * 2, uint32_t(16));
+        ReleasedRun* newRuns = (ReleasedRun*)GenericAllocator::Alloc(allocator, newCapacity * sizeof(ReleasedRun), alignof(ReleasedRun));
+        if (newRuns == nullptr)
+        {
+            return false;
+        }
+
+        if (releasedRuns)
+        {
+            std::memcpy(newRuns, releasedRuns, count * sizeof(ReleasedRun));
+            GenericAllocator::Free(allocator, releasedRuns);
+        }
+        releasedRuns = newRuns;
+        releasedRunsCapacity = newCapacity;
+    }
+
+    releasedRuns[count].begin = begin;
+    releasedRuns[count].end = end;
+    releasedRunsCount.store(count + 1, std::memory_order_relaxed);
+    return true;
+}
+
+bool Allocator::PoolBucket::RearmReleasedRun()
+{
+    // the run is neither released nor in the free lists until FreeRun is done, allocations that find everything empty meanwhile
+    // wait for it the same way they wait for Trim (instead of growing the bucket or spilling to the next one)
+    internal::SpinLockGuard trimGuard(trimLock);
+    ReleasedRun run;
+    {
+        internal::SpinLockGuard lock(commitLock);
+        uint32_t count = releasedRunsCount.load(std::memory_order_relaxed);
+        if (count == 0)
+        {
+            return false;
+        }
+        run = releasedRuns[count - 1];
+        trimEpoch.fetch_add(1, std::memory_order_acq_rel);
+        releasedRunsCount.store(count - 1, std::memory_order_release);
+    }
+
+    // writing next pointers faults the released pages back in
+    size_t elementsCount = size_t((run.end - run.begin) / elementSize);
+    SM_ASSERT(elementsCount > 0);
+    FreeRun(shards[GetHomeShardIndex()], run.begin, elementsCount);
+    trimEpoch.fetch_add(1, std::memory_order_release);
+    return true;
+}
+
+bool Allocator::PoolBucket::WaitForTrim(uint32_t listsEpoch)
+{
+    uint32_t epoch = trimEpoch.load(std::memory_order_acquire);
+    if (epoch == listsEpoch && (epoch & 1) == 0)
+    {
+        return false;
+    }
+
+    while ((epoch & 1) != 0)
+    {
+        std::this_thread::yield();
+        epoch = trimEpoch.load(std::memory_order_acquire);
+    }
+    return true;
+}
+
+size_t Allocator::PoolBucket::Trim(GenericAllocator::TInstance allocator)
+{
+    if (pageSize == 0)
+    {
+        return 0;
+    }
+
+    if (useReturnChannels)
+    {
+        DrainReturnChannels();
+    }
+
+    // allocations that find the lists empty meanwhile wait for the trim instead of growing the bucket or spilling to the next one
+    internal::SpinLockGuard lock(trimLock);
+    trimEpoch.fetch_add(1, std::memory_order_acq_rel);
+    size_t releasedBytes = TrimFreeLists(allocator);
+    trimEpoch.fetch_add(1, std::memory_order_release);
+    return releasedBytes;
+}
+
+size_t Allocator::PoolBucket::TrimFreeLists(GenericAllocator::TInstance allocator)
+{
+    // detach the whole free list of every shard
+    std::array<TaggedIndex, SMM_BUCKET_SHARDS_COUNT> heads;
+    std::array<uint8_t*, SMM_BUCKET_SHARDS_COUNT> tails;
+    size_t count = 0;
+    for (uint32_t i = 0; i <= shardsMask; i++)
+    {
+        heads[i] = shards[i].Exchange(TaggedIndex::MakeInvalid());
+        tails[i] = nullptr;
+        for (TaggedIndex it = heads[i]; it.IsValid(); it = *((TaggedIndex*)(tails[i])))
+        {
+            tails[i] = pData + it.p.offset;
+            count++;
+        }
+    }
+
+    if (count == 0)
+    {
+        return 0;
+    }
+
+    internal::ElementOffset* offsets = (internal::ElementOffset*)GenericAllocator::Alloc(allocator, count * sizeof(internal::ElementOffset),
+                                                                                           alignof(internal::ElementOffset));
+    if (offsets == nullptr)
+    {
+        // out of memory, attach the lists back as is
+        for (uint32_t i = 0; i <= shardsMask; i++)
+        {
+            if (heads[i].IsValid())
+            {
+                FreeInterval(shards[i], pData + heads[i].p.offset, tails[i]);
+            }
+        }
+        return 0;
+    }
+
+    count = 0;
+    for (uint32_t i = 0; i <= shardsMask; i++)
+    {
+        for (TaggedIndex it = heads[i]; it.IsValid(); it = *((TaggedIndex*)(pData + it.p.offset)))
+        {
+            offsets[count++] = it.p.offset;
+        }
+    }
+
+    // find runs of adjacent free elements
+    std::sort(offsets, offsets + count);
+
+    size_t releasedBytes = 0;
+    size_t keptCount = 0;
+    size_t i = 0;
+    while (i < count)
+    {
+        size_t j = i + 1;
+        while (j < count && offsets[j] == (offsets[j - 1] + elementSize))
+        {
+            j++;
+        }
+
+        internal::ElementOffset runBegin = offsets[i];
+        internal::ElementOffset runEnd = internal::ElementOffset(offsets[j - 1] + elementSize);
+        size_t purgeBegin = Align(runBegin, pageSize);
+        size_t purgeEnd = runEnd & ~(pageSize - 1);
+
+        // nobody can touch detached elements, so it is safe to purge pages before the run is published
+        if (purgeEnd > purgeBegin && VirtualMemory::Purge(pData + purgeBegin, purgeEnd - purgeBegin) &&
+            AddReleasedRun(allocator, runBegin, runEnd))
+        {
+            releasedBytes += (purgeEnd - purgeBegin);
+        }
+        else
+        {
+            // keep elements in the free list
+            for (size_t k = i; k < j; k++)
+            {
+                offsets[keptCount++] = offsets[k];
+            }
+        }
+        i = j;
+    }
+
+    // attach the rest back (address ordered)
+    FreeSortedOffsets(offsets, keptCount);
+    GenericAllocator::Free(allocator, offsets);
+    return releasedBytes;
+}
+
+Allocator::Allocator(GenericAllocator::TInstance allocator)
+    : bucketsCount(0)
+    , bucketsGranuleShift(0)
+    , bucketsGranulesCount(0)
+    , pBufferEnd(nullptr)
+    , pBuffer(nullptr)
+    , arenaReservedBytes(0)
+    , flags(ALLOCATOR_DEFAULT)
+    , gAllocator(allocator)
+    , cpuCache(nullptr)
+    , cacheId(SMM_MAX_THREAD_CACHES_COUNT)
+    , cacheGeneration(0)
+    , autoCacheOptionsCount(0)
+    , autoCacheWarmup(CACHE_COLD)
+    , threadCacheBudget(SMM_THREAD_CACHE_BUDGET_BYTES)
+    , scavengeEpoch(0)
+    , scavengeWatermark(0)
+    , cacheList(nullptr)
+{
+    cacheListLock.locked.store(0);
+    cacheId = internal::AcquireThreadCacheId(cacheGeneration);
+}
+
+Allocator::~Allocator()
+{
+    // the cache of the current thread is flushed here, threads that exit later skip the caches of the released id
+    DestroyThreadCache();
+    internal::ReleaseThreadCacheId(cacheId);
+    cacheId = SMM_MAX_THREAD_CACHES_COUNT;
+
+    // caches of the threads that are still alive and explicit caches that were not destroyed
+    while (cacheList != nullptr)
+    {
+        FreeThreadCache(cacheList);
+    }
+
+    if (pBuffer == nullptr)
+    {
+        return;
+    }
+
+    internal::DestroyCpuCache(cpuCache);
+    cpuCache = nullptr;
+
+    for (size_t i = 0; i < bucketsCount; i++)
+    {
+        GenericAllocator::Free(gAllocator, buckets[i].releasedRuns);
+        buckets[i].releasedRuns = nullptr;
+    }
+
+    if (arenaReservedBytes > 0)
+    {
+        VirtualMemory::Release(pBuffer, arenaReservedBytes);
+    }
+    else
+    {
+        GenericAllocator::Free(gAllocator, pBuffer);
+    }
+    pBuffer = nullptr;
+}
+
+// Return the next power of 2 higher than the input
+// If the input is already a power of 2, the output will be the same as the input.
+// Got this from Brian Sharp's SWEng mailing list.
+SMM_INLINE int GetNextPow2(uint32_t n)
+{
+    n -= 1;
+
+    n |= n >> 16;
+    n |= n >> 8;
+    n |= n >> 4;
+    n |= n >> 2;
+    n |= n >> 1;
+
+    return n + 1;
+}
+
+void Allocator::Init(uint32_t _bucketsCount, size_t _bucketSizeInBytes, uint32_t _flags)
+{
+    /*
+    for (size_t bucketIdx = 0; bucketIdx < 64; bucketIdx++)
+    {
+        printf("%zu->%zu, ", bucketIdx, sm::getBucketSizeInBytesByIndex(bucketIdx));
+    }
+    */
+
+    SM_ASSERT(_bucketsCount > 0 && _bucketsCount <= SMM_MAX_BUCKET_COUNT);
+    if (_bucketsCount >= SMM_MAX_BUCKET_COUNT)
+    {
+        _bucketsCount = SMM_MAX_BUCKET_COUNT;
+    }
+
+    // every bucket gets the same amount of memory
+    std::array<size_t, SMM_MAX_BUCKET_COUNT> bucketsCapacity;
+    std::array<size_t, SMM_MAX_BUCKET_COUNT> bucketsElementSize;
+    for (size_t i = 0; i < _bucketsCount; i++)
+    {
+        bucketsCapacity[i] = _bucketSizeInBytes;
+        bucketsElementSize[i] = GetBucketSizeInBytesByIndex(i);
+    }
+    InitBuckets(bucketsCapacity.data(), bucketsElementSize.data(), _bucketsCount, _flags);
+}
+
+void Allocator::Init(std::initializer_list<size_t> bucketsCapacityInBytes, uint32_t _flags)
+{
+    SM_ASSERT(bucketsCapacityInBytes.size() > 0 && bucketsCapacityInBytes.size() <= SMM_MAX_BUCKET_COUNT);
+
+    std::array<size_t, SMM_MAX_BUCKET_COUNT> bucketsCapacity;
+    std::array<size_t, SMM_MAX_BUCKET_COUNT> bucketsElementSize;
+    size_t _bucketsCount = 0;
+    for (size_t capacityInBytes : bucketsCapacityInBytes)
+    {
+        if (_bucketsCount >= SMM_MAX_BUCKET_COUNT)
+        {
+            break;
+        }
+        bucketsCapacity[_bucketsCount] = capacityInBytes;
+        bucketsElementSize[_bucketsCount] = GetBucketSizeInBytesByIndex(_bucketsCount);
+        _bucketsCount++;
+    }
+    InitBuckets(bucketsCapacity.data(), bucketsElementSize.data(), _bucketsCount, _flags);
+}
+
+void Allocator::InitBuckets(const size_t* bucketsCapacity, const size_t* bucketsElementSize, size_t _bucketsCount, uint32_t _flags)
+{
+    if (bucketsCount > 0)
+    {
+        // already initialized
+        return;
+    }
+
+    if (_bucketsCount == 0)
+    {
+        return;
+    }
+
+    bucketsCount = _bucketsCount;
+
+    if (_flags & (ALLOCATOR_GROWABLE_BUCKETS | ALLOCATOR_HUGE_PAGES))
+    {
+        _flags |= ALLOCATOR_VIRTUAL_ARENA;
+    }
+
+    // drop features one by one if the system can't provide them
+    const uint32_t kVirtualArenaFlags = ALLOCATOR_VIRTUAL_ARENA | ALLOCATOR_GROWABLE_BUCKETS | ALLOCATOR_HUGE_PAGES;
+    std::array<uint32_t, 3> candidates = {_flags, _flags & ~uint32_t(ALLOCATOR_GROWABLE_BUCKETS), _flags & ~kVirtualArenaFlags};
+    for (size_t i = 0; i < candidates.size(); i++)
+    {
+        if (i > 0 && candidates[i] == candidates[i - 1])
+        {
+            continue;
+        }
+
+        if (CreateArena(bucketsCapacity, bucketsElementSize, candidates[i]))
+        {
+            break;
+        }
+    }
+
+    if (flags & ALLOCATOR_PER_CPU_CACHE)
+    {
+        cpuCache = internal::CreateCpuCache(this);
+        if (cpuCache == nullptr)
+        {
+            flags &= ~uint32_t(ALLOCATOR_PER_CPU_CACHE);
+        }
+    }
+}
+
+bool Allocator::CreateArena(const size_t* bucketsCapacity, const size_t* bucketsElementSize, uint32_t arenaFlags)
+{
+    const bool isVirtual = (arenaFlags & ALLOCATOR_VIRTUAL_ARENA) != 0;
+    const bool isGrowable = (arenaFlags & ALLOCATOR_GROWABLE_BUCKETS) != 0;
+
+    // every bucket of the virtual arena starts at the page boundary to be committed independently
+    size_t pageSize = 0;
+    size_t alignment = kMaxValidAlignment;
+    if (isVirtual)
+    {
+        pageSize = (arenaFlags & ALLOCATOR_HUGE_PAGES) ? VirtualMemory::GetHugePageSize() : VirtualMemory::GetPageSize();
+        alignment = std::max(alignment, pageSize);
+    }
+
+    // bucket capacity and address range (growable buckets reserve address range for all the segments)
+    std::array<size_t, SMM_MAX_BUCKET_COUNT> capacities;
+    std::array<size_t, SMM_MAX_BUCKET_COUNT> ranges;
+#ifdef SMM_WIDE_OFFSETS
+    // bucket offsets are 64-bit, bucket size is limited by the user address space
+    const uint64_t maxBucketSize = (uint64_t(1) << 47) - alignment;
+#else
+    // bucket offsets are 32-bit
+    const uint64_t maxBucketSize = (uint64_t(UINT32_MAX) + 1) - alignment;
+#endif
+    for (size_t i = 0; i < bucketsCount; i++)
+    {
+        capacities[i] = Align(size_t(std::min(uint64_t(bucketsCapacity[i]), maxBucketSize)), alignment);
+        uint64_t rangeInBytes = isGrowable ? std::min(uint64_t(capacities[i]) * SMM_MAX_BUCKET_SEGMENTS_COUNT, maxBucketSize) : capacities[i];
+        ranges[i] = size_t(std::max(rangeInBytes, uint64_t(capacities[i])));
+    }
+
+    // find the smallest granule that fits all the buckets into the lookup table
+    uint32_t shift = 0;
+    while ((size_t(1) << shift) < alignment)
+    {
+        shift++;
+    }
+
+    uint64_t totalBytesCount = 0;
+    for (;; shift++)
+    {
+        uint64_t granulesTotal = 0;
+        for (size_t i = 0; i < bucketsCount; i++)
+        {
+            granulesTotal += (uint64_t(ranges[i]) + ((uint64_t(1) << shift) - 1)) >> shift;
+        }
+
+        if (granulesTotal <= bucketsLookup.size())
+        {
+            totalBytesCount = granulesTotal << shift;
+            break;
+        }
+    }
+
+    if (totalBytesCount >= uint64_t(SIZE_MAX))
+    {
+        return false;
+    }
+
+    uint8_t* pArena = nullptr;
+    size_t arenaBytesCount = size_t(totalBytesCount);
+    if (isVirtual)
+    {
+        if ((arenaFlags & ALLOCATOR_HUGE_PAGES) && !isGrowable)
+        {
+            // explicit huge pages are committed up front
+            pArena = (uint8_t*)VirtualMemory::AllocateHugePages(arenaBytesCount);
+            if (pArena)
+            {
+                pageSize = 0;
+            }
+        }
+
+        if (pArena == nullptr)
+        {
+            pArena = (uint8_t*)VirtualMemory::ReserveAligned(arenaBytesCount, pageSize);
+            if (pArena && (arenaFlags & ALLOCATOR_HUGE_PAGES))
+            {
+                // best effort, pages are committed in huge page sized chunks to let the OS use transparent huge pages
+                VirtualMemory::AdviseHugePages(pArena, arenaBytesCount);
+            }
+        }
+    }
+    else
+    {
+        pArena = (uint8_t*)GenericAllocator::Alloc(gAllocator, arenaBytesCount, kMaxValidAlignment);
+    }
+
+    if (pArena == nullptr)
+    {
+        return false;
+    }
+
+    flags = arenaFlags;
+    pBuffer = pArena;
+    pBufferEnd = pBuffer + arenaBytesCount + 1;
+    arenaReservedBytes = isVirtual ? arenaBytesCount : 0;
+    bucketsGranuleShift = shift;
+    bucketsGranulesCount = arenaBytesCount >> shift;
+
+    size_t offset = 0;
+    for (size_t i = 0; i < bucketsCount; i++)
+    {
+        PoolBucket& bucket = buckets[i];
+        bucket.pData = pBuffer + offset;
+        bucket.pBufferEnd = bucket.pData + ranges[i];
+        size_t elementSize = bucketsElementSize[i];
+        SM_ASSERT(IsAligned(elementSize, kMinValidAlignment));
+        SM_ASSERT(IsAligned(size_t(bucket.pData), kMaxValidAlignment) && "Incorrect alignment detected!");
+        bucket.Create(elementSize, capacities[i], pageSize, flags);
+
+        size_t bucketGranulesCount = Align(ranges[i], size_t(1) << shift) >> shift;
+        for (size_t j = 0; j < bucketGranulesCount; j++)
+        {
+            bucketsLookup[(offset >> shift) + j] = uint8_t(i);
+        }
+        offset += (bucketGranulesCount << shift);
+    }
+    SM_ASSERT(offset == arenaBytesCount);
+    return true;
+}
+
+size_t Allocator::Trim()
+{
+    // pages of the arena allocated using generic allocator can't be purged
+    if ((flags & ALLOCATOR_VIRTUAL_ARENA) == 0)
+    {
+        return 0;
+    }
+
+    size_t releasedBytes = 0;
+    for (size_t i = 0; i < bucketsCount; i++)
+    {
+        releasedBytes += buckets[i].Trim(gAllocator);
     }
+    return releasedBytes;
 }
 
 } // namespace sm
@@ -48,10 +48,22 @@
 
 #if defined(_M_X64) || _LP64
 #define SMMMALLOC_X64
+#ifdef SMM_WIDE_OFFSETS
+#define SMM_MAX_CACHE_ITEMS_COUNT (3)
+#else
 #define SMM_MAX_CACHE_ITEMS_COUNT (7)
+#endif
 #else
 #define SMMMALLOC_X86
 #define SMM_MAX_CACHE_ITEMS_COUNT (10)
+#ifdef SMM_WIDE_OFFSETS
+#error "SMM_WIDE_OFFSETS requires a 64-bit target"
+#endif
+#endif
+
+// SMM_WIDE_OFFSETS: 64-bit element offsets and free list tags (double width CAS), buckets can be larger than 4Gb
+#if defined(SMM_WIDE_OFFSETS) && defined(_MSC_VER)
+#include <intrin.h>
 #endif
 
 #ifndef SMM_CACHE_LINE_SIZE
@@ -62,6 +74,46 @@
 #define SMM_MAX_BUCKET_COUNT (62)
 #endif
 
+// size of the pointer to bucket lookup table (bigger table = less address space padding between buckets)
+#ifndef SMM_BUCKETS_LOOKUP_TABLE_SIZE
+#define SMM_BUCKETS_LOOKUP_TABLE_SIZE (4096)
+#endif
+
+// maximum number of segments in a growable bucket (see ALLOCATOR_GROWABLE_BUCKETS)
+#ifndef SMM_MAX_BUCKET_SEGMENTS_COUNT
+#define SMM_MAX_BUCKET_SEGMENTS_COUNT (16)
+#endif
+
+// per CPU caches are built on Linux restartable sequences (x86-64 only, see ALLOCATOR_PER_CPU_CACHE)
+#if !defined(SMM_DISABLE_PER_CPU_CACHE) && defined(__linux__) && defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#define SMM_PER_CPU_CACHE_SUPPORT
+#endif
+
+// number of free list shards per bucket (see ALLOCATOR_SHARDED_BUCKETS), must be power of two
+#ifndef SMM_BUCKET_SHARDS_COUNT
+#define SMM_BUCKET_SHARDS_COUNT (8)
+#endif
+
+// number of cached elements per bucket per CPU (see ALLOCATOR_PER_CPU_CACHE)
+#ifndef SMM_PER_CPU_CACHE_ITEMS_COUNT
+#define SMM_PER_CPU_CACHE_ITEMS_COUNT (128)
+#endif
+
+// default per thread byte budget of the adaptive thread cache (see ALLOCATOR_ADAPTIVE_THREAD_CACHE)
+#ifndef SMM_THREAD_CACHE_BUDGET_BYTES
+#define SMM_THREAD_CACHE_BUDGET_BYTES (2 * 1024 * 1024)
+#endif
+
+// max number of elements a thread cache returns to the bucket per free call (see ALLOCATOR_INCREMENTAL_FLUSH)
+#ifndef SMM_INCREMENTAL_FLUSH_CHUNK
+#define SMM_INCREMENTAL_FLUSH_CHUNK (2048)
+#endif
+
+// maximum number of alive allocators that can have thread caches (other allocators work without thread caches), must be <= 64
+#ifndef SMM_MAX_THREAD_CACHES_COUNT
+#define SMM_MAX_THREAD_CACHES_COUNT (16)
+#endif
+
 #if !defined(SMM_LINEAR_PARTITIONING) && !defined(SMM_FLOAT_PARTITIONING) && !defined(SMM_PL_PARTITIONING)
 
 //#define SMM_LINEAR_PARTITIONING
@@ -130,6 +182,16 @@
 #define SMM_NOINLINE __attribute__((__noinline__))
 #endif
 
+// thread caches table storage (plain TLS, no dynamic initialization), initial-exec model makes the access a single fs/gs relative
+// load, but such variables can't live in a library loaded with dlopen (use SMM_OUT_OF_LINE_TLS for such builds)
+#ifdef _MSC_VER
+#define SMM_TLS_VARIABLE __declspec(thread)
+#elif defined(__ELF__) && !defined(SMM_OUT_OF_LINE_TLS)
+#define SMM_TLS_VARIABLE __thread __attribute__((tls_model("initial-exec")))
+#else
+#define SMM_TLS_VARIABLE __thread
+#endif
+
 #ifdef SMMALLOC_ENABLE_ASSERTS
 #include <assert.h>
 //#define SM_ASSERT(x) assert(x)
@@ -170,6 +232,11 @@ struct BucketStats
     std::atomic<size_t> hitCount;
     std::atomic<size_t> missCount;
     std::atomic<size_t> freeCount;
+    std::atomic<size_t> growCount;
+    std::atomic<size_t> returnChannelHitCount;
+    std::atomic<size_t> cacheGrowCount;
+    std::atomic<size_t> cacheShrinkCount;
+    std::atomic<size_t> stealCount;
 
     BucketStats()
     {
@@ -177,6 +244,11 @@ struct BucketStats
         hitCount.store(0);
         missCount.store(0);
         freeCount.store(0);
+        growCount.store(0);
+        returnChannelHitCount.store(0);
+        cacheGrowCount.store(0);
+        cacheShrinkCount.store(0);
+        stealCount.store(0);
     }
 };
 #endif
@@ -188,14 +260,77 @@ enum CacheWarmupOptions
     CACHE_HOT = 2,  // all tls buckets are filled from centralized storage
 };
 
+enum AllocatorFlags
+{
+    ALLOCATOR_DEFAULT = 0,               // arena is allocated using generic allocator
+    ALLOCATOR_VIRTUAL_ARENA = 1 << 0,    // arena address range is reserved up front, pages are committed on demand
+    ALLOCATOR_EAGER_INIT = 1 << 1,       // build the whole free list at creation time (touches every page of the arena)
+    ALLOCATOR_GROWABLE_BUCKETS = 1 << 2, // exhausted buckets grow by attaching extra segments (implies virtual arena)
+    ALLOCATOR_HUGE_PAGES = 1 << 3,       // buckets are aligned to the huge page size and backed by huge pages if possible (implies virtual arena)
+    ALLOCATOR_PER_CPU_CACHE = 1 << 4,    // elements are cached per CPU (rseq), threads that can't use rseq fall back to the thread cache
+    ALLOCATOR_SHARDED_BUCKETS = 1 << 5,  // bucket free lists are split into SMM_BUCKET_SHARDS_COUNT shards to reduce contention
+    ALLOCATOR_RETURN_CHANNELS = 1 << 6,  // chains freed by thread caches are handed to the shard whose threads ran out of elements
+    ALLOCATOR_ADAPTIVE_THREAD_CACHE = 1 << 7, // thread cache capacities are upper limits, actual ones follow refill/flush feedback
+    ALLOCATOR_CACHE_STEALING = 1 << 8,        // exhausted buckets take elements parked in other threads' caches before falling back
+    ALLOCATOR_INCREMENTAL_FLUSH = 1 << 9,     // full thread caches drain to half over the next frees, SMM_INCREMENTAL_FLUSH_CHUNK at a time
+};
+
+class Allocator;
+
 namespace internal
 {
+#ifdef SMM_WIDE_OFFSETS
+typedef uint64_t ElementOffset;
+#else
+// offset of the element inside of the bucket (also used as a free list tag)
+typedef uint32_t ElementOffset;
+#endif
+
 struct TlsPoolBucket;
-}
+struct ThreadCache;
+struct CpuCache;
+
+// bucket of the explicit thread cache
+SMM_INLINE TlsPoolBucket* GetCacheBucket(ThreadCache* cache, size_t index);
+
+// return nullptr if per CPU caches are not supported by the system
+CpuCache* CreateCpuCache(Allocator* alloc);
+void DestroyCpuCache(CpuCache* cache);
+
+#ifdef SMM_PER_CPU_CACHE_SUPPORT
+// return nullptr / false if the current thread can't use restartable sequences
+void* CpuCacheAlloc(CpuCache* cache, size_t bucketIndex);
+bool CpuCacheFree(CpuCache* cache, size_t bucketIndex, void* p);
+// take up to 'count' elements cached by the current CPU (no refill), returns number of elements taken
+size_t CpuCacheAllocBatch(CpuCache* cache, size_t bucketIndex, size_t count, void** out);
+#endif
+} // namespace internal
+
+// explicit thread cache (see Allocator::CreateCache)
+typedef internal::ThreadCache ThreadCache;
 
-internal::TlsPoolBucket* GetTlsBucket(size_t index);
+// thread cache bucket of the allocator with the given cache id and generation (empty bucket if the thread has no cache for this allocator)
+#ifdef SMM_OUT_OF_LINE_TLS
+internal::TlsPoolBucket* GetTlsBucket(uint32_t cacheId, uint32_t cacheGeneration, size_t index);
+#else
+SMM_INLINE internal::TlsPoolBucket* GetTlsBucket(uint32_t cacheId, uint32_t cacheGeneration, size_t index);
+#endif
 
-#ifdef SMM_FLOAT_PARTITIONING
+// unique per thread number used to pick the home shard of the bucket free list
+uint32_t GetTlsShardIndex();
+
+namespace internal
+{
+// every alive allocator gets its own slot in the per thread caches table (SMM_MAX_THREAD_CACHES_COUNT if all slots are taken)
+// the slot generation changes on release, caches that threads still keep for a destroyed allocator are never used again
+uint32_t AcquireThreadCacheId(uint32_t& cacheGeneration);
+void ReleaseThreadCacheId(uint32_t cacheId);
+
+// thread cache of the current thread (nullptr if the thread has no cache for this allocator)
+ThreadCache* GetThreadCache(uint32_t cacheId, uint32_t cacheGeneration);
+// thread caches are destroyed automatically on thread exit (unless the allocator is already destroyed)
+void SetThreadCache(uint32_t cacheId, uint32_t cacheGeneration, ThreadCache* cache);
+} // namespace internal
 
 namespace SmallFloat
 {
@@ -260,8 +395,6 @@ SMM_INLINE uint32_t floatToUint(uint32_t floatValue)
 
 } // namespace SmallFloat
 
-#endif
-
 SMM_INLINE bool IsAligned(size_t v, size_t alignment)
 {
     size_t lowBits = v & (alignment - 1);
@@ -276,61 +409,102 @@ SMM_INLINE size_t Align(size_t val, size_t alignment)
     return r;
 }
 
-SMM_INLINE size_t GetBucketIndexBySize(size_t bytesCount)
+// Bucket partitioning schemes (see SMM_LINEAR_PARTITIONING, SMM_PL_PARTITIONING and SMM_FLOAT_PARTITIONING above)
+struct LinearPartitioning
 {
-#if defined(SMM_LINEAR_PARTITIONING)
-    size_t bucketIndex = ((bytesCount - 1) >> 4);
-    return bucketIndex;
-#elif defined(SMM_FLOAT_PARTITIONING)
-    SM_ASSERT(bytesCount < UINT32_MAX && "Can't handle allocation size >= 4Gb");
-    uint32_t _bucketIndex = SmallFloat::uintToFloatRoundUp(uint32_t(bytesCount));
-    // remap to a proper range
-    uint32_t bucketIndex = (_bucketIndex < 12) ? 0 : (_bucketIndex - 12);
-    return size_t(bucketIndex);
-#elif defined(SMM_PL_PARTITIONING)
-    SM_ASSERT(bytesCount > 0);
-    size_t size = (bytesCount - 1);
-    size_t p0 = (size >> 4);
-    size_t p1 = (7 + (size >> 7));
-    size_t p2 = (13 + (size >> 9));
-    size_t bucketIndex = (size <= 127) ? p0 : ((size > 1023) ? p2 : p1);
-    return bucketIndex;
-#else
-#error Unknown partitioning scheme!
-#endif
-}
+    static SMM_INLINE size_t GetBucketIndexBySize(size_t bytesCount)
+    {
+        size_t bucketIndex = ((bytesCount - 1) >> 4);
+        return bucketIndex;
+    }
+
+    static SMM_INLINE size_t GetBucketSizeInBytesByIndex(size_t bucketIndex)
+    {
+        size_t sizeInBytes = 16 + bucketIndex * 16;
+        return sizeInBytes;
+    }
+};
+
+struct PiecewiseLinearPartitioning
+{
+    static SMM_INLINE size_t GetBucketIndexBySize(size_t bytesCount)
+    {
+        SM_ASSERT(bytesCount > 0);
+        size_t size = (bytesCount - 1);
+        size_t p0 = (size >> 4);
+        size_t p1 = (7 + (size >> 7));
+        size_t p2 = (13 + (size >> 9));
+        size_t bucketIndex = (size <= 127) ? p0 : ((size > 1023) ? p2 : p1);
+        return bucketIndex;
+    }
+
+    static SMM_INLINE size_t GetBucketSizeInBytesByIndex(size_t bucketIndex)
+    {
+        size_t p0 = ((bucketIndex + 1) << 4);
+        size_t p1 = ((bucketIndex - 6) << 7);
+        size_t p2 = ((bucketIndex - 12) << 9);
+        size_t sizeInBytes = (bucketIndex <= 7) ? p0 : ((bucketIndex > 14) ? p2 : p1);
+        return sizeInBytes;
+    }
+};
 
-SMM_INLINE size_t GetBucketSizeInBytesByIndex(size_t bucketIndex)
+struct FloatPartitioning
 {
+    static SMM_INLINE size_t GetBucketIndexBySize(size_t bytesCount)
+    {
+        SM_ASSERT(bytesCount < UINT32_MAX && "Can't handle allocation size >= 4Gb");
+        uint32_t _bucketIndex = SmallFloat::uintToFloatRoundUp(uint32_t(bytesCount));
+        // remap to a proper range
+        uint32_t bucketIndex = (_bucketIndex < 12) ? 0 : (_bucketIndex - 12);
+        return size_t(bucketIndex);
+    }
+
+    static SMM_INLINE size_t GetBucketSizeInBytesByIndex(size_t bucketIndex)
+    {
+        // remap to a proper range
+        uint32_t _bucketIndex = uint32_t(bucketIndex) + 12;
+        uint32_t sizeInBytes = SmallFloat::floatToUint(_bucketIndex);
+        return size_t(sizeInBytes);
+    }
+};
+
 #if defined(SMM_LINEAR_PARTITIONING)
-    size_t sizeInBytes = 16 + bucketIndex * 16;
-    return sizeInBytes;
+typedef LinearPartitioning DefaultPartitioning;
 #elif defined(SMM_FLOAT_PARTITIONING)
-    // remap to a proper range
-    uint32_t _bucketIndex = uint32_t(bucketIndex) + 12;
-    uint32_t sizeInBytes = SmallFloat::floatToUint(_bucketIndex);
-    return size_t(sizeInBytes);
+typedef FloatPartitioning DefaultPartitioning;
 #elif defined(SMM_PL_PARTITIONING)
-    size_t p0 = ((bucketIndex + 1) << 4);
-    size_t p1 = ((bucketIndex - 6) << 7);
-    size_t p2 = ((bucketIndex - 12) << 9);
-    size_t sizeInBytes = (bucketIndex <= 7) ? p0 : ((bucketIndex > 14) ? p2 : p1);
-    return sizeInBytes;
+typedef PiecewiseLinearPartitioning DefaultPartitioning;
 #else
 #error Unknown partitioning scheme!
 #endif
-}
+
+SMM_INLINE size_t GetBucketIndexBySize(size_t bytesCount) { return DefaultPartitioning::GetBucketIndexBySize(bytesCount); }
+
+SMM_INLINE size_t GetBucketSizeInBytesByIndex(size_t bucketIndex) { return DefaultPartitioning::GetBucketSizeInBytesByIndex(bucketIndex); }
 
 SMM_INLINE size_t Min(size_t a, size_t b) { return (a < b) ? a : b; }
 
 struct GenericAllocator
 {
-    typedef void* TInstance;
+    // fallback allocator backend, every callback receives 'context' as the first argument
+    struct Backend
+    {
+        void* context;
+        void* (*alloc)(void* context, size_t bytesCount, size_t alignment);
+        void (*free)(void* context, void* p);
+        // optional, used only if usableSize is provided (alloc + copy + free otherwise)
+        void* (*realloc)(void* context, void* p, size_t bytesCount, size_t alignment);
+        // optional, if the backend can't report block sizes a small header is stored in front of every block
+        size_t (*usableSize)(void* context, void* p);
+    };
+
+    // nullptr instance is the default (std::malloc based) backend
+    typedef const Backend* TInstance;
 
     static TInstance Invalid();
     static bool IsValid(TInstance instance);
 
-    static TInstance Create();
+    static TInstance Create(const Backend* backend = nullptr);
     static void Destroy(TInstance instance);
 
     static void* Alloc(TInstance instance, size_t bytesCount, size_t alignment);
@@ -350,6 +524,93 @@ struct GenericAllocator
     };
 };
 
+struct VirtualMemory
+{
+    static size_t GetPageSize();
+    static size_t GetHugePageSize();
+
+    // reserve address range (no physical memory is committed)
+    static void* Reserve(size_t bytesCount);
+    // reserve address range aligned to the given power of two alignment
+    static void* ReserveAligned(size_t bytesCount, size_t alignment);
+    // allocate committed memory backed by explicit huge pages (returns nullptr if huge pages are unavailable)
+    static void* AllocateHugePages(size_t bytesCount);
+    // ask the OS to back the range with transparent huge pages
+    static bool AdviseHugePages(void* p, size_t bytesCount);
+    // commit pages of the previously reserved range (range must be page aligned)
+    static bool Commit(void* p, size_t bytesCount);
+    // give physical pages back to the OS, pages stay accessible and are zero/garbage filled on the next touch
+    static bool Purge(void* p, size_t bytesCount);
+    // release the whole reserved range
+    static void Release(void* p, size_t bytesCount);
+};
+
+namespace internal
+{
+struct SpinLock
+{
+    std::atomic<uint32_t> locked;
+
+    void Lock();
+    void Unlock() { locked.store(0, std::memory_order_release); }
+};
+
+struct SpinLockGuard
+{
+    SpinLock& lock;
+
+    explicit SpinLockGuard(SpinLock& _lock)
+        : lock(_lock)
+    {
+        lock.Lock();
+    }
+    ~SpinLockGuard() { lock.Unlock(); }
+
+    SpinLockGuard(const SpinLockGuard&) = delete;
+    SpinLockGuard& operator=(const SpinLockGuard&) = delete;
+};
+
+#ifdef SMM_WIDE_OFFSETS
+// double width compare and swap (dst must be 16 bytes aligned), 'expected' is updated with the current value on failure
+SMM_INLINE bool CompareExchange128(uint64_t* dst, uint64_t* expected, const uint64_t* desired)
+{
+#if defined(_MSC_VER)
+    return _InterlockedCompareExchange128((volatile long long*)dst, (long long)desired[1], (long long)desired[0], (long long*)expected) != 0;
+#elif defined(__x86_64__)
+    bool result;
+    __asm__ __volatile__("lock cmpxchg16b %1\n\t"
+                         "setz %0"
+                         : "=q"(result), "+m"(*(volatile uint64_t(*)[2])dst), "+a"(expected[0]), "+d"(expected[1])
+                         : "b"(desired[0]), "c"(desired[1])
+                         : "cc", "memory");
+    return result;
+#elif defined(__aarch64__)
+    uint64_t lo;
+    uint64_t hi;
+    uint32_t failed;
+    do
+    {
+        __asm__ __volatile__("ldaxp %0, %1, %2" : "=&r"(lo), "=&r"(hi) : "Q"(*(volatile uint64_t(*)[2])dst) : "memory");
+        if (lo != expected[0] || hi != expected[1])
+        {
+            __asm__ __volatile__("clrex" : : : "memory");
+            expected[0] = lo;
+            expected[1] = hi;
+            return false;
+        }
+        __asm__ __volatile__("stlxp %w0, %2, %3, %1"
+                             : "=&r"(failed), "=Q"(*(volatile uint64_t(*)[2])dst)
+                             : "r"(desired[0]), "r"(desired[1])
+                             : "memory");
+    } while (failed != 0);
+    return true;
+#else
+#error "SMM_WIDE_OFFSETS is not supported on this platform"
+#endif
+}
+#endif
+} // namespace internal
+
 class Allocator
 {
   public:
@@ -360,6 +621,8 @@ class Allocator
     static const size_t kMaxValidAlignment = 4096;
 
     friend struct internal::TlsPoolBucket;
+    friend struct internal::CpuCache;
+    template <typename TConfig> friend class StaticAllocator;
 
     SMM_INLINE bool IsReadable(void* p) const { return (uintptr_t(p) > kMaxValidAlignment); }
 
@@ -370,49 +633,307 @@ class Allocator
 #endif
     struct alignas(SMM_CACHE_LINE_SIZE) PoolBucket
     {
+        // free list node (stored inside of the free element)
         union TaggedIndex
         {
             struct
             {
-                uint32_t tag;
-                uint32_t offset;
+                internal::ElementOffset tag;
+                internal::ElementOffset offset;
             } p;
+#ifndef SMM_WIDE_OFFSETS
             uint64_t u;
-            static const uint64_t Invalid = UINT64_MAX;
+#endif
+
+            SMM_INLINE bool IsValid() const { return p.offset != kInvalidOffset; }
+
+            static SMM_INLINE TaggedIndex MakeInvalid()
+            {
+                TaggedIndex v;
+                v.p.tag = kInvalidOffset;
+                v.p.offset = kInvalidOffset;
+                return v;
+            }
+
+            static const internal::ElementOffset kInvalidOffset = internal::ElementOffset(-1);
+        };
+
+        // range of free elements whose pages were returned to the OS by Trim
+        struct ReleasedRun
+        {
+            internal::ElementOffset begin;
+            internal::ElementOffset end;
+        };
+
+        // lock free list of free elements, every shard lives on its own cache line
+        struct alignas(SMM_CACHE_LINE_SIZE) Shard
+        {
+#ifdef SMM_WIDE_OFFSETS
+            // 16 bytes (tag and offset are updated using double width CAS)
+            alignas(16) std::atomic<uint64_t> head[2];
+            // 8 bytes
+            std::atomic<uint64_t> globalTag;
+            // 8 bytes (take-all list of chains returned by other threads, see ALLOCATOR_RETURN_CHANNELS)
+            std::atomic<internal::ElementOffset> returnHead;
+
+            Shard()
+                : globalTag(0)
+                , returnHead(TaggedIndex::kInvalidOffset)
+            {
+                Store(TaggedIndex::MakeInvalid());
+            }
+
+            // halves are read separately, torn value is never used since it fails the following CAS
+            SMM_INLINE TaggedIndex Load() const
+            {
+                TaggedIndex v;
+                v.p.tag = head[0].load(std::memory_order_acquire);
+                v.p.offset = head[1].load(std::memory_order_acquire);
+                return v;
+            }
+
+            SMM_INLINE void Store(TaggedIndex v)
+            {
+                head[0].store(v.p.tag);
+                head[1].store(v.p.offset);
+            }
+
+            SMM_INLINE bool CompareExchange(TaggedIndex& expected, TaggedIndex desired)
+            {
+                static_assert(sizeof(std::atomic<uint64_t>) == sizeof(uint64_t), "Unexpected atomic layout");
+                return internal::CompareExchange128((uint64_t*)&head[0], &expected.p.tag, &desired.p.tag);
+            }
+#else
+            // 8 bytes
+            std::atomic<uint64_t> head;
+            // 4 bytes
+            std::atomic<uint32_t> globalTag;
+            // 4 bytes (take-all list of chains returned by other threads, see ALLOCATOR_RETURN_CHANNELS)
+            std::atomic<internal::ElementOffset> returnHead;
+
+            Shard()
+                : head(TaggedIndex::MakeInvalid().u)
+                , globalTag(0)
+                , returnHead(TaggedIndex::kInvalidOffset)
+            {
+            }
+
+            SMM_INLINE TaggedIndex Load() const
+            {
+                TaggedIndex v;
+                v.u = head.load();
+                return v;
+            }
+
+            SMM_INLINE void Store(TaggedIndex v) { head.store(v.u); }
+
+            SMM_INLINE bool CompareExchange(TaggedIndex& expected, TaggedIndex desired) { return head.compare_exchange_strong(expected.u, desired.u); }
+#endif
+
+            SMM_INLINE TaggedIndex Exchange(TaggedIndex desired)
+            {
+                TaggedIndex v = Load();
+                while (!CompareExchange(v, desired))
+                {
+                }
+                return v;
+            }
         };
 
-        // 8 bytes
-        std::atomic<uint64_t> head;
         // 4/8 bytes
         uint8_t* pData;
         // 4/8 bytes
         uint8_t* pBufferEnd;
+        // 4 bytes (number of used shards - 1)
+        uint32_t shardsMask;
+        // 4 bytes (shard whose threads ran out of cached elements, kNoHungryShard if return channels are disabled or nobody asked yet)
+        std::atomic<uint32_t> hungryShardIndex;
+        // 1 byte
+        bool useReturnChannels;
+        // 4/8 bytes
+        size_t elementSize;
+        // 4/8 bytes (offset of the first never used element)
+        std::atomic<size_t> frontier;
+        // 4/8 bytes (number of usable bytes, grows up to pBufferEnd for growable buckets)
+        std::atomic<size_t> capacity;
+        // 4/8 bytes (zero if bucket can't grow)
+        size_t segmentSize;
+        // 4/8 bytes
+        std::atomic<size_t> committedBytes;
+        // 4/8 bytes (commit/purge granularity, zero if memory is committed up front)
+        size_t pageSize;
+        // 4 bytes (guards commit, grow and released runs)
+        internal::SpinLock commitLock;
+        // 4 bytes (serializes Trim and RearmReleasedRun calls)
+        internal::SpinLock trimLock;
+        // 4 bytes (odd while Trim has the free lists detached or a released run is being put back to the free list)
+        std::atomic<uint32_t> trimEpoch;
         // 4 bytes
-        std::atomic<uint32_t> globalTag;
+        std::atomic<uint32_t> releasedRunsCount;
+        // 4 bytes
+        uint32_t releasedRunsCapacity;
+        // 4/8 bytes
+        ReleasedRun* releasedRuns;
+
+        std::array<Shard, SMM_BUCKET_SHARDS_COUNT> shards;
+
+        static const uint32_t kNoHungryShard = UINT32_MAX;
+        // maximum number of elements detached by a single chain CAS (longer walks rarely win the CAS under contention)
+        static const uint32_t kMaxChainWalkLength = 256;
 
 #ifdef SMMALLOC_STATS_SUPPORT
         BucketStats bucketStats;
 #endif
 
         PoolBucket()
-            : head(TaggedIndex::Invalid)
-            , pData(nullptr)
+            : pData(nullptr)
             , pBufferEnd(nullptr)
-            , globalTag(0)
+            , shardsMask(0)
+            , hungryShardIndex(kNoHungryShard)
+            , useReturnChannels(false)
+            , elementSize(0)
+            , frontier(0)
+            , capacity(0)
+            , segmentSize(0)
+            , committedBytes(0)
+            , pageSize(0)
+            , trimEpoch(0)
+            , releasedRunsCount(0)
+            , releasedRunsCapacity(0)
+            , releasedRuns(nullptr)
+        {
+            commitLock.locked.store(0);
+            trimLock.locked.store(0);
+        }
+
+        void Create(size_t elementSize, size_t capacityInBytes, size_t pageSize, uint32_t flags);
+
+        // make sure that the first 'bytesCount' bytes of the bucket are committed (virtual arena only)
+        SMM_NOINLINE bool CommitUpTo(size_t bytesCount);
+
+        // attach one more segment to the bucket (growable buckets only)
+        SMM_NOINLINE bool Grow(size_t bytesCount);
+
+        // return pages fully covered by free elements to the OS, returns number of released bytes (virtual arena only)
+        size_t Trim(GenericAllocator::TInstance allocator);
+        size_t TrimFreeLists(GenericAllocator::TInstance allocator);
+        bool AddReleasedRun(GenericAllocator::TInstance allocator, internal::ElementOffset begin, internal::ElementOffset end);
+
+        // put elements of the previously released run back to the free list
+        SMM_NOINLINE bool RearmReleasedRun();
+
+        // wait until Trim gives the free lists back, returns false if no Trim ran since the lists were checked ('listsEpoch')
+        SMM_NOINLINE bool WaitForTrim(uint32_t listsEpoch);
+
+        // link sorted offsets into the list 'offsets[0]->...->offsets[count-1]' and attach it to the lock free list
+        void FreeSortedOffsets(const internal::ElementOffset* offsets, size_t count);
+
+        // link 'elementsCount' adjacent elements starting from 'begin' and attach them to the shard
+        void FreeRun(Shard& shard, internal::ElementOffset begin, size_t elementsCount);
+
+        SMM_INLINE uint32_t GetHomeShardIndex() const { return (shardsMask == 0) ? 0 : (GetTlsShardIndex() & shardsMask); }
+
+        // mark the home shard as hungry and take up to 'maxCount' elements returned to it by other threads, returns number of elements
+        uint32_t AllocFromReturnChannel(uint32_t maxCount, internal::ElementOffset* offsets);
+
+        // move chains of all return channels to the shard free lists, returns false if there was nothing to move
+        SMM_NOINLINE bool DrainReturnChannels();
+
+        // detach up to 'maxCount' free elements (a chain is taken from the free list with a single CAS), returns number of elements
+        uint32_t AllocChain(uint32_t maxCount, internal::ElementOffset* offsets);
+        uint32_t AllocChainFromShard(Shard& shard, uint32_t maxCount, internal::ElementOffset* offsets);
+
+        // take up to 'count' elements a chain at a time, returns number of elements (less than 'count' if the bucket is exhausted)
+        SMM_NOINLINE size_t AllocBatch(size_t count, void** out);
+
+        // take up to 'maxCount' never used adjacent elements starting from 'offset', returns number of elements
+        // 'listsEpoch' is the trim epoch loaded before the free lists were found empty
+        SMM_INLINE uint32_t AllocFromFrontier(uint32_t maxCount, size_t& offset, uint32_t listsEpoch)
         {
+            uint32_t count = 0;
+            offset = frontier.load(std::memory_order_relaxed);
+            while (true)
+            {
+                size_t capacityInBytes = capacity.load(std::memory_order_relaxed);
+                count = (offset < capacityInBytes) ? uint32_t(std::min(size_t(maxCount), (capacityInBytes - offset) / elementSize)) : 0;
+                if (count == 0)
+                {
+                    // bucket is exhausted (lists might look empty only because Trim detached them, never grow the bucket then)
+                    if (segmentSize == 0 || trimEpoch.load(std::memory_order_acquire) != listsEpoch || (listsEpoch & 1) != 0 ||
+                        !Grow(offset + elementSize))
+                    {
+                        return 0;
+                    }
+                    continue;
+                }
+
+                // commit before the range is published, the frontier never points past the committed memory (nothing is lost if the
+                // commit fails and chain walkers can rely on the committed size)
+                size_t end = offset + count * elementSize;
+                if (end > committedBytes.load(std::memory_order_acquire) && !CommitUpTo(end))
+                {
+                    return 0;
+                }
+
+                if (frontier.compare_exchange_weak(offset, end, std::memory_order_relaxed))
+                {
+                    return count;
+                }
+            }
         }
 
-        void Create(size_t elementSize);
+        SMM_INLINE void* AllocFromFrontier(uint32_t listsEpoch)
+        {
+            size_t offset = 0;
+            return (AllocFromFrontier(1, offset, listsEpoch) != 0) ? (pData + offset) : nullptr;
+        }
 
         SMM_INLINE void* Alloc()
+        {
+            while (true)
+            {
+                uint32_t listsEpoch = trimEpoch.load(std::memory_order_acquire);
+
+                // home shard first, then steal from the neighbour shards
+                uint32_t homeShardIndex = GetHomeShardIndex();
+                for (uint32_t i = 0; i <= shardsMask; i++)
+                {
+                    void* p = AllocFromShard(shards[(homeShardIndex + i) & shardsMask]);
+                    if (p)
+                    {
+                        return p;
+                    }
+                }
+
+                // all lists are empty, pick up elements returned to the threads that no longer ask for them
+                if (useReturnChannels && DrainReturnChannels())
+                {
+                    continue;
+                }
+
+                // reuse trimmed elements first
+                if (releasedRunsCount.load(std::memory_order_acquire) != 0 && RearmReleasedRun())
+                {
+                    continue;
+                }
+
+                // take never used element
+                void* p = AllocFromFrontier(listsEpoch);
+                if (p == nullptr && WaitForTrim(listsEpoch))
+                {
+                    continue;
+                }
+                return p;
+            }
+        }
+
+        SMM_INLINE void* AllocFromShard(Shard& shard)
         {
             uint8_t* p = nullptr;
-            TaggedIndex headValue;
-            headValue.u = head.load();
+            TaggedIndex headValue = shard.Load();
             while (true)
             {
-                // list is empty, exiting
-                if (headValue.u == TaggedIndex::Invalid)
+                if (!headValue.IsValid())
                 {
                     return nullptr;
                 }
@@ -445,7 +966,7 @@ class Allocator
                 */
 
                 // try to swap head to head->next
-                if (head.compare_exchange_strong(headValue.u, nextValue.u))
+                if (shard.CompareExchange(headValue, nextValue))
                 {
                     // success
                     break;
@@ -457,7 +978,34 @@ class Allocator
             return p;
         }
 
-        SMM_INLINE void FreeInterval(void* _pHead, void* _pTail)
+        SMM_INLINE void FreeInterval(void* _pHead, void* _pTail) { FreeInterval(shards[GetHomeShardIndex()], _pHead, _pTail); }
+
+        // attach chain flushed by a thread cache (handed to the hungry shard if there is one)
+        SMM_INLINE void FreeChain(void* _pHead, void* _pTail)
+        {
+            uint32_t hungryIndex = hungryShardIndex.load(std::memory_order_relaxed);
+            if (hungryIndex != kNoHungryShard)
+            {
+                PushReturnChain(shards[hungryIndex], _pHead, _pTail);
+                return;
+            }
+            FreeInterval(_pHead, _pTail);
+        }
+
+        SMM_INLINE void PushReturnChain(Shard& shard, void* _pHead, void* _pTail)
+        {
+            // return channel is only emptied as a whole (take-all), so pushing the chain doesn't suffer from the ABA problem
+            internal::ElementOffset headOffset = (internal::ElementOffset)((uint8_t*)_pHead - pData);
+            TaggedIndex* pTail = (TaggedIndex*)_pTail;
+            internal::ElementOffset next = shard.returnHead.load(std::memory_order_relaxed);
+            do
+            {
+                pTail->p.tag = 0;
+                pTail->p.offset = next;
+            } while (!shard.returnHead.compare_exchange_weak(next, headOffset, std::memory_order_release, std::memory_order_relaxed));
+        }
+
+        SMM_INLINE void FreeInterval(Shard& shard, void* _pHead, void* _pTail)
         {
             uint8_t* pHead = (uint8_t*)_pHead;
             uint8_t* pTail = (uint8_t*)_pTail;
@@ -476,14 +1024,13 @@ class Allocator
             if one of the thread will superseded before step #3, it will actually roll back the counter (for all other threads) by writing
             the old value into globalTag.
             */
-            uint32_t tag = globalTag.fetch_add(1, std::memory_order_relaxed);
+            internal::ElementOffset tag = shard.globalTag.fetch_add(1, std::memory_order_relaxed);
 
             TaggedIndex nodeValue;
-            nodeValue.p.offset = (uint32_t)(pHead - pData);
+            nodeValue.p.offset = (internal::ElementOffset)(pHead - pData);
             nodeValue.p.tag = tag;
 
-            TaggedIndex headValue;
-            headValue.u = head.load();
+            TaggedIndex headValue = shard.Load();
 
             while (true)
             {
@@ -491,7 +1038,7 @@ class Allocator
                 *((TaggedIndex*)(pTail)) = headValue;
 
                 // try to swap node and head
-                if (head.compare_exchange_strong(headValue.u, nodeValue.u))
+                if (shard.CompareExchange(headValue, nodeValue))
                 {
                     // succes
                     break;
@@ -503,6 +1050,9 @@ class Allocator
         SMM_INLINE bool IsMyAlloc(void* p) const { return (p >= pData && p < pBufferEnd); }
     };
     static_assert(alignof(PoolBucket) == 64, "PoolBucket exepected be aligned with the cache line size to prevent false cache sharing");
+    static_assert(SMM_MAX_BUCKET_COUNT <= 256, "Bucket index must fit into the lookup table entry");
+    static_assert(SMM_BUCKET_SHARDS_COUNT > 0 && (SMM_BUCKET_SHARDS_COUNT & (SMM_BUCKET_SHARDS_COUNT - 1)) == 0,
+                  "Shards count must be power of two");
 #ifdef _MSC_VER
 #pragma warning(pop)
 #endif
@@ -511,36 +1061,130 @@ class Allocator
     void CreateThreadCache(CacheWarmupOptions warmupOptions, std::initializer_list<uint32_t> options);
     void DestroyThreadCache();
 
+    // per thread byte budget shared by all buckets of the adaptive thread cache (applied to caches created after the call)
+    void SetThreadCacheBudget(size_t bytesCount) { threadCacheBudget = bytesCount; }
+
+    // current thread cache capacity (elements) of the bucket, zero if the current thread has no cache
+    size_t GetThreadCacheCapacity(size_t bucketIndex) const;
+
+    // return all elements cached by the current thread to the buckets (e.g. before the thread blocks for a long time)
+    void FlushThreadCache();
+
+    // ask every thread to return cached elements above the watermark, threads do it on their next thread cache refill or flush
+    void Scavenge();
+
+    // number of elements per bucket a thread keeps on scavenge requests (zero by default)
+    void SetScavengeWatermark(uint32_t elementsCount) { scavengeWatermark = elementsCount; }
+
+    // thread cache object owned by the caller (e.g. one per worker of a job system with migrating fibers), it is not bound to any
+    // thread but must not be used by two threads at the same time, pass it to Alloc / Free explicitly (no TLS lookup)
+    ThreadCache* CreateCache(CacheWarmupOptions warmupOptions, std::initializer_list<uint32_t> options);
+    void DestroyCache(ThreadCache* cache);
+
+    // threads without a cache create one using this profile on their first allocation (must be called before the allocator is
+    // shared between threads, empty options disable automatic creation), threads can outlive the allocator (caches that are
+    // still alive when the allocator is destroyed are released by the destructor and never touched by their threads again)
+    void SetAutoThreadCache(CacheWarmupOptions warmupOptions, std::initializer_list<uint32_t> options);
+
   private:
     size_t bucketsCount;
-    size_t bucketSizeInBytes;
+    // arena is split into power of two sized granules, every granule belongs to exactly one bucket
+    uint32_t bucketsGranuleShift;
+    size_t bucketsGranulesCount;
     uint8_t* pBufferEnd;
-    std::array<uint8_t*, SMM_MAX_BUCKET_COUNT> bucketsDataBegin;
+    std::array<uint8_t, SMM_BUCKETS_LOOKUP_TABLE_SIZE> bucketsLookup;
     std::array<PoolBucket, SMM_MAX_BUCKET_COUNT> buckets;
-    std::unique_ptr<uint8_t, GenericAllocator::Deleter> pBuffer;
+    uint8_t* pBuffer;
+    // size of the reserved address range (zero if arena is allocated using generic allocator)
+    size_t arenaReservedBytes;
+    uint32_t flags;
     GenericAllocator::TInstance gAllocator;
+    // per CPU caches (nullptr if ALLOCATOR_PER_CPU_CACHE is not set or not supported)
+    internal::CpuCache* cpuCache;
+    // slot in the per thread caches table and its generation
+    uint32_t cacheId;
+    uint32_t cacheGeneration;
+    // automatic thread cache profile (see SetAutoThreadCache)
+    std::array<uint32_t, SMM_MAX_BUCKET_COUNT> autoCacheOptions;
+    size_t autoCacheOptionsCount;
+    CacheWarmupOptions autoCacheWarmup;
+    // see SetThreadCacheBudget
+    size_t threadCacheBudget;
+    // incremented by Scavenge, threads compare it with the value seen last time
+    std::atomic<uint32_t> scavengeEpoch;
+    // see SetScavengeWatermark
+    uint32_t scavengeWatermark;
+    // all thread caches of the allocator (destroyed with the allocator if their threads are still alive), thieves hold the lock
+    // while they read the victim's storage so caches can't be destroyed under them (see ALLOCATOR_CACHE_STEALING)
+    internal::SpinLock cacheListLock;
+    internal::ThreadCache* cacheList;
 
 #ifdef SMMALLOC_STATS_SUPPORT
     GlobalStats globalStats;
 #endif
 
-    SMM_INLINE void* AllocFromCache(internal::TlsPoolBucket* __restrict _self) const;
+    SMM_INLINE void* AllocFromCache(internal::TlsPoolBucket* __restrict _self);
+
+    // take up to 'count' elements from the L0 and L1 storage (no refills), returns number of elements
+    SMM_INLINE size_t AllocBatchFromCache(internal::TlsPoolBucket* __restrict _self, size_t count, void** out);
+
+    // thread cache slow paths (cache ran dry / cache overflowed), handle scavenge requests and adaptive capacities
+    SMM_NOINLINE void OnThreadCacheMiss(internal::TlsPoolBucket* _self);
+    SMM_NOINLINE void OnThreadCacheOverflow(internal::TlsPoolBucket* _self);
+    void CheckScavengeEpoch(internal::ThreadCache* cache);
+    bool ResizeThreadCache(internal::ThreadCache* cache, size_t bucketIndex, uint32_t capacity);
+
+    // number of elements the thread cache returns to the bucket at once (bounded if ALLOCATOR_INCREMENTAL_FLUSH is set)
+    SMM_INLINE uint32_t BoundFlushCount(uint32_t count) const
+    {
+        return (flags & ALLOCATOR_INCREMENTAL_FLUSH) ? std::min(count, uint32_t(SMM_INCREMENTAL_FLUSH_CHUNK)) : count;
+    }
+
+    // move the bottom half of the L1 storage to the stealable range / take back what thieves left (owner thread only)
+    void PublishStealRange(internal::ThreadCache* cache, size_t bucketIndex);
+    void ReclaimStealRange(internal::ThreadCache* cache, size_t bucketIndex);
+
+    // take a batch of elements from other threads' stealable ranges, returns nullptr if nothing is published
+    SMM_NOINLINE void* StealFromThreadCaches(size_t bucketIndex, internal::ThreadCache* self);
+
+    void CreateThreadCache(CacheWarmupOptions warmupOptions, const uint32_t* options, size_t optionsCount);
+
+    // create / destroy thread cache object (not attached to the current thread)
+    internal::ThreadCache* AllocThreadCache(CacheWarmupOptions warmupOptions, const uint32_t* options, size_t optionsCount);
+    void FreeThreadCache(internal::ThreadCache* cache);
 
-    template <bool useCacheL0> SMM_INLINE bool ReleaseToCache(internal::TlsPoolBucket* __restrict _self, void* _p);
+    // create thread cache from the automatic profile, returns false if the thread already has a cache
+    SMM_NOINLINE bool CreateAutoThreadCache();
+
+    // returns false if the element is not taken by the cache (no cache / cache is full and 'allowFlush' is false)
+    template <bool useCacheL0, bool allowFlush> SMM_INLINE bool ReleaseToCache(internal::TlsPoolBucket* __restrict _self, void* _p);
 
     SMM_INLINE size_t FindBucket(const void* p) const
     {
         // if p is our pointer it located inside pBuffer and pBufferEnd
-        // pBuffer and bucketsDataBegin[0] the same pointers
-        uintptr_t index = (uintptr_t)p - (uintptr_t)bucketsDataBegin[0];
+        uintptr_t index = ((uintptr_t)p - (uintptr_t)pBuffer) >> bucketsGranuleShift;
 
         // if p is less than pBuffer we get very huge number due to overflow and this is valid result, since bucketIndex checked before use
         // if p is greater than pBufferEnd we get huge number and this is valid result too, since bucketIndex checked before use
-
-        size_t r = (index / bucketSizeInBytes);
-        return r;
+        if (index >= bucketsGranulesCount)
+        {
+            return SMM_MAX_BUCKET_COUNT;
+        }
+        return bucketsLookup[index];
     }
 
+    // size to bucket and pointer to bucket mapping of the runtime configured allocator
+    struct RuntimeGeometry
+    {
+        static SMM_INLINE size_t GetBucketIndexBySize(size_t bytesCount) { return sm::GetBucketIndexBySize(bytesCount); }
+        static SMM_INLINE size_t GetBucketSizeInBytesByIndex(size_t bucketIndex) { return sm::GetBucketSizeInBytesByIndex(bucketIndex); }
+        static SMM_INLINE size_t GetBucketsCount(const Allocator* allocator) { return allocator->bucketsCount; }
+        static SMM_INLINE size_t FindBucket(const Allocator* allocator, const void* p) { return allocator->FindBucket(p); }
+    };
+
+    void InitBuckets(const size_t* bucketsCapacity, const size_t* bucketsElementSize, size_t bucketsCount, uint32_t flags);
+    bool CreateArena(const size_t* bucketsCapacity, const size_t* bucketsElementSize, uint32_t arenaFlags);
+
     SMM_INLINE PoolBucket* GetBucketByIndex(size_t bucketIndex)
     {
         if (bucketIndex >= bucketsCount)
@@ -559,7 +1203,9 @@ class Allocator
         return &buckets[bucketIndex];
     }
 
-    template <bool enableStatistic> SMM_INLINE void* Allocate(size_t _bytesCount, size_t alignment)
+    // cache is the explicit thread cache to use, nullptr means the cache of the current thread
+    template <bool enableStatistic, typename TGeometry>
+    SMM_INLINE void* Allocate(internal::ThreadCache* cache, size_t _bytesCount, size_t alignment)
     {
         SM_ASSERT(alignment <= kMaxValidAlignment);
 
@@ -579,19 +1225,36 @@ class Allocator
 #endif
 
         size_t bytesCount = Align(_bytesCount, alignment);
-        size_t bucketIndex = GetBucketIndexBySize(bytesCount);
+        size_t bucketIndex = TGeometry::GetBucketIndexBySize(bytesCount);
 
 #ifdef SMMALLOC_STATS_SUPPORT
         bool isValidBucket = false;
 #endif
 
-        if (bucketIndex < bucketsCount)
+        if (bucketIndex < TGeometry::GetBucketsCount(this))
         {
 #ifdef SMMALLOC_STATS_SUPPORT
             isValidBucket = true;
 #endif
-            // try to handle allocation using local thread cache
-            void* pRes = AllocFromCache(GetTlsBucket(bucketIndex));
+            void* pRes = nullptr;
+#ifdef SMM_PER_CPU_CACHE_SUPPORT
+            // try to handle allocation using current CPU cache (explicit thread caches bypass it)
+            if (cpuCache && cache == nullptr)
+            {
+                pRes = internal::CpuCacheAlloc(cpuCache, bucketIndex);
+            }
+            if (pRes == nullptr)
+#endif
+            {
+                // try to handle allocation using local thread cache
+                internal::TlsPoolBucket* tlsBucket =
+                    (cache == nullptr) ? GetTlsBucket(cacheId, cacheGeneration, bucketIndex) : internal::GetCacheBucket(cache, bucketIndex);
+                pRes = AllocFromCache(tlsBucket);
+                if (pRes == nullptr && cache == nullptr && SM_UNLIKELY(autoCacheOptionsCount != 0) && CreateAutoThreadCache())
+                {
+                    pRes = AllocFromCache(GetTlsBucket(cacheId, cacheGeneration, bucketIndex));
+                }
+            }
             if (pRes)
             {
 #ifdef SMMALLOC_STATS_SUPPORT
@@ -606,11 +1269,15 @@ class Allocator
         }
 
         // never "overflow" allocation to more than 4 buckets (for performance reasons)
-        const size_t maxBucketIndex = Min(bucketsCount, bucketIndex + 4);
+        const size_t maxBucketIndex = Min(TGeometry::GetBucketsCount(this), bucketIndex + 4);
         while (bucketIndex < maxBucketIndex)
         {
             SM_ASSERT(bucketIndex < buckets.size());
             void* pRes = buckets[bucketIndex].Alloc();
+            if (pRes == nullptr && (flags & ALLOCATOR_CACHE_STEALING))
+            {
+                pRes = StealFromThreadCaches(bucketIndex, cache);
+            }
             if (pRes)
             {
 #ifdef SMMALLOC_STATS_SUPPORT
@@ -636,7 +1303,7 @@ class Allocator
             do
             {
                 bucketIndex++;
-            } while (!IsAligned(GetBucketSizeInBytesByIndex(bucketIndex), alignment));
+            } while (!IsAligned(TGeometry::GetBucketSizeInBytesByIndex(bucketIndex), alignment));
         }
 
 #ifdef SMMALLOC_STATS_SUPPORT
@@ -657,14 +1324,7 @@ class Allocator
         return GenericAllocator::Alloc(gAllocator, _bytesCount, alignment);
     }
 
-  public:
-    Allocator(GenericAllocator::TInstance allocator);
-
-    void Init(uint32_t bucketsCount, size_t bucketSizeInBytes);
-
-    SMM_INLINE void* Alloc(size_t _bytesCount, size_t alignment) { return Allocate<true>(_bytesCount, alignment); }
-
-    SMM_INLINE void Free(void* p)
+    template <typename TGeometry> SMM_INLINE void Deallocate(internal::ThreadCache* cache, void* p)
     {
         // Assume that p is the pointer that is allocated by passing the zero size.
         if (SM_UNLIKELY(!IsReadable(p)))
@@ -672,20 +1332,10 @@ class Allocator
             return;
         }
 
-        size_t bucketIndex = FindBucket(p);
-        if (bucketIndex < bucketsCount)
+        size_t bucketIndex = TGeometry::FindBucket(this, p);
+        if (bucketIndex < TGeometry::GetBucketsCount(this))
         {
-#ifdef SMMALLOC_STATS_SUPPORT
-            buckets[bucketIndex].bucketStats.freeCount.fetch_add(1, std::memory_order_relaxed);
-#endif
-
-            if (ReleaseToCache<true>(GetTlsBucket(bucketIndex), p))
-            {
-                return;
-            }
-
-            PoolBucket* bucket = &buckets[bucketIndex];
-            bucket->FreeInterval(p, p);
+            DeallocateToBucket(cache, bucketIndex, p);
             return;
         }
 
@@ -693,24 +1343,189 @@ class Allocator
         GenericAllocator::Free(gAllocator, (uint8_t*)p);
     }
 
-    SMM_INLINE void* Realloc(void* p, size_t bytesCount, size_t alignment)
+    // free when the size and alignment passed to Allocate are known, the bucket is computed from the size
+    template <typename TGeometry> SMM_INLINE void DeallocateSized(internal::ThreadCache* cache, void* p, size_t _bytesCount, size_t alignment)
     {
-        // Assume that p is the pointer that is allocated by passing the zero size. So no real reallocation required.
-        if (!IsReadable(p))
+        if (SM_UNLIKELY(_bytesCount == 0))
+        {
+            Deallocate<TGeometry>(cache, p);
+            return;
+        }
+
+        size_t bucketIndex = TGeometry::GetBucketIndexBySize(Align(_bytesCount, alignment));
+
+        // allocation can overflow to one of the next buckets or to the generic allocator, such pointers take the regular path
+        if (SM_LIKELY(bucketIndex < TGeometry::GetBucketsCount(this) && buckets[bucketIndex].IsMyAlloc(p)))
+        {
+            SM_ASSERT(TGeometry::FindBucket(this, p) == bucketIndex && "Wrong size passed to sized free");
+            DeallocateToBucket(cache, bucketIndex, p);
+            return;
+        }
+
+        SM_ASSERT((TGeometry::FindBucket(this, p) > bucketIndex || TGeometry::FindBucket(this, p) >= TGeometry::GetBucketsCount(this)) &&
+                  "Wrong size passed to sized free");
+        Deallocate<TGeometry>(cache, p);
+    }
+
+    SMM_INLINE void DeallocateToBucket(internal::ThreadCache* cache, size_t bucketIndex, void* p)
+    {
+#ifdef SMMALLOC_STATS_SUPPORT
+        buckets[bucketIndex].bucketStats.freeCount.fetch_add(1, std::memory_order_relaxed);
+#endif
+
+#ifdef SMM_PER_CPU_CACHE_SUPPORT
+        if (cpuCache && cache == nullptr && internal::CpuCacheFree(cpuCache, bucketIndex, p))
+        {
+            return;
+        }
+#endif
+
+        internal::TlsPoolBucket* tlsBucket =
+            (cache == nullptr) ? GetTlsBucket(cacheId, cacheGeneration, bucketIndex) : internal::GetCacheBucket(cache, bucketIndex);
+        if (ReleaseToCache<true, true>(tlsBucket, p))
+        {
+            return;
+        }
+
+        PoolBucket* bucket = &buckets[bucketIndex];
+        bucket->FreeInterval(p, p);
+    }
+
+    template <bool enableStatistic, typename TGeometry>
+    SMM_INLINE size_t AllocateBatch(size_t _bytesCount, size_t alignment, size_t count, void** out)
+    {
+        SM_ASSERT(alignment <= kMaxValidAlignment);
+        if (SM_UNLIKELY(_bytesCount == 0))
+        {
+            for (size_t i = 0; i < count; i++)
+            {
+                out[i] = (void*)alignment;
+            }
+            return count;
+        }
+
+        size_t bytesCount = Align(_bytesCount, alignment);
+        size_t bucketIndex = TGeometry::GetBucketIndexBySize(bytesCount);
+        size_t doneCount = 0;
+        if (bucketIndex < TGeometry::GetBucketsCount(this))
+        {
+            // drain the per CPU (or thread) cache first, then take whole chains from the bucket
+#ifdef SMM_PER_CPU_CACHE_SUPPORT
+            if (cpuCache)
+            {
+                doneCount = internal::CpuCacheAllocBatch(cpuCache, bucketIndex, count, out);
+            }
+            if (doneCount == 0)
+#endif
+            {
+                doneCount = AllocBatchFromCache(GetTlsBucket(cacheId, cacheGeneration, bucketIndex), count, out);
+            }
+#ifdef SMMALLOC_STATS_SUPPORT
+            size_t cachedCount = doneCount;
+#endif
+            if (doneCount < count)
+            {
+                doneCount += buckets[bucketIndex].AllocBatch(count - doneCount, out + doneCount);
+            }
+
+#ifdef SMMALLOC_STATS_SUPPORT
+            if (enableStatistic)
+            {
+                globalStats.totalNumAllocationAttempts.fetch_add(doneCount, std::memory_order_relaxed);
+                globalStats.totalAllocationsServed.fetch_add(doneCount, std::memory_order_relaxed);
+                buckets[bucketIndex].bucketStats.cacheHitCount.fetch_add(cachedCount, std::memory_order_relaxed);
+                buckets[bucketIndex].bucketStats.hitCount.fetch_add(doneCount - cachedCount, std::memory_order_relaxed);
+            }
+#endif
+        }
+
+        // bucket is exhausted (or the size is not handled by buckets), allocate the rest one by one (failed ones are skipped)
+        for (size_t i = doneCount; i < count; i++)
         {
-            return Alloc(bytesCount, alignment);
+            void* p = Allocate<enableStatistic, TGeometry>(nullptr, _bytesCount, alignment);
+            if (p != nullptr)
+            {
+                out[doneCount++] = p;
+            }
+        }
+        std::fill(out + doneCount, out + count, nullptr);
+        return doneCount;
+    }
+
+    template <typename TGeometry> SMM_INLINE void DeallocateBatch(void** ptrs, size_t count)
+    {
+        // overflow of the thread cache is linked into a chain per bucket, every chain is attached with a single CAS
+        std::array<uint8_t*, SMM_MAX_BUCKET_COUNT> heads;
+        std::array<uint8_t*, SMM_MAX_BUCKET_COUNT> tails;
+        size_t bucketsCount = TGeometry::GetBucketsCount(this);
+        std::fill(heads.begin(), heads.begin() + bucketsCount, nullptr);
+
+        for (size_t i = 0; i < count; i++)
+        {
+            void* p = ptrs[i];
+            if (SM_UNLIKELY(!IsReadable(p)))
+            {
+                continue;
+            }
+
+            size_t bucketIndex = TGeometry::FindBucket(this, p);
+            if (bucketIndex >= bucketsCount)
+            {
+                GenericAllocator::Free(gAllocator, (uint8_t*)p);
+                continue;
+            }
+
+#ifdef SMMALLOC_STATS_SUPPORT
+            buckets[bucketIndex].bucketStats.freeCount.fetch_add(1, std::memory_order_relaxed);
+#endif
+            if (ReleaseToCache<true, false>(GetTlsBucket(cacheId, cacheGeneration, bucketIndex), p))
+            {
+                continue;
+            }
+
+            // inner tags become head tags once the elements above them are popped (and are compared by the pop CAS then),
+            // they are numbered by the batch position the same way as TlsPoolBucket::ReturnL1CacheToMaster numbers them
+            uint8_t* pBlock = (uint8_t*)p;
+            if (heads[bucketIndex] == nullptr)
+            {
+                heads[bucketIndex] = pBlock;
+            }
+            else
+            {
+                PoolBucket::TaggedIndex* pTag = (PoolBucket::TaggedIndex*)tails[bucketIndex];
+                pTag->p.tag = internal::ElementOffset(i);
+                pTag->p.offset = internal::ElementOffset(pBlock - buckets[bucketIndex].pData);
+            }
+            tails[bucketIndex] = pBlock;
+        }
+
+        for (size_t bucketIndex = 0; bucketIndex < bucketsCount; bucketIndex++)
+        {
+            if (heads[bucketIndex] != nullptr)
+            {
+                buckets[bucketIndex].FreeChain(heads[bucketIndex], tails[bucketIndex]);
+            }
+        }
+    }
+
+    template <typename TGeometry> SMM_INLINE void* Reallocate(void* p, size_t bytesCount, size_t alignment)
+    {
+        // Assume that p is the pointer that is allocated by passing the zero size. So no real reallocation required.
+        if (!IsReadable(p))
+        {
+            return Allocate<true, TGeometry>(nullptr, bytesCount, alignment);
         }
 
         if (bytesCount == 0)
         {
-            Free(p);
+            Deallocate<TGeometry>(nullptr, p);
             return nullptr;
         }
 
-        size_t bucketIndex = FindBucket(p);
-        if (bucketIndex < bucketsCount)
+        size_t bucketIndex = TGeometry::FindBucket(this, p);
+        if (bucketIndex < TGeometry::GetBucketsCount(this))
         {
-            size_t elementSize = GetBucketSizeInBytesByIndex(bucketIndex);
+            size_t elementSize = TGeometry::GetBucketSizeInBytesByIndex(bucketIndex);
             if (bytesCount <= elementSize)
             {
                 // reuse existing memory
@@ -718,7 +1533,7 @@ class Allocator
             }
 
             // alloc new memory block and move memory
-            void* p2 = Alloc(bytesCount, alignment);
+            void* p2 = Allocate<true, TGeometry>(nullptr, bytesCount, alignment);
 
             if (p2 == nullptr)
             {
@@ -735,7 +1550,7 @@ class Allocator
                 std::memmove(p2, p, elementSize);
             }
 
-            Free(p);
+            Deallocate<TGeometry>(nullptr, p);
 
             return p2;
         }
@@ -754,10 +1569,10 @@ class Allocator
 
         // check if we need to realloc from generic allocator to smmalloc
         size_t __bytesCount = Align(bytesCount, alignment);
-        size_t __bucketIndex = GetBucketIndexBySize(__bytesCount);
-        if (__bucketIndex < bucketsCount)
+        size_t __bucketIndex = TGeometry::GetBucketIndexBySize(__bytesCount);
+        if (__bucketIndex < TGeometry::GetBucketsCount(this))
         {
-            void* p2 = Alloc(bytesCount, alignment);
+            void* p2 = Allocate<true, TGeometry>(nullptr, bytesCount, alignment);
             // Assume that p is the pointer that is allocated by passing the zero size. No preserve memory conents is requried.
             if (IsReadable(p))
             {
@@ -774,7 +1589,7 @@ class Allocator
         return GenericAllocator::Realloc(gAllocator, p, bytesCount, alignment);
     }
 
-    SMM_INLINE size_t GetUsableSize(void* p)
+    template <typename TGeometry> SMM_INLINE size_t GetUsableSizeImpl(void* p)
     {
         // Assume that p is the pointer that is allocated by passing the zero size.
         if (!IsReadable(p))
@@ -782,25 +1597,25 @@ class Allocator
             return 0;
         }
 
-        size_t bucketIndex = FindBucket(p);
-        if (bucketIndex < bucketsCount)
+        size_t bucketIndex = TGeometry::FindBucket(this, p);
+        if (bucketIndex < TGeometry::GetBucketsCount(this))
         {
-            size_t elementSize = GetBucketSizeInBytesByIndex(bucketIndex);
+            size_t elementSize = TGeometry::GetBucketSizeInBytesByIndex(bucketIndex);
             return elementSize;
         }
 
         return GenericAllocator::GetUsableSpace(gAllocator, p);
     }
 
-    SMM_INLINE int32_t GetBucketIndex(void* _p)
+    template <typename TGeometry> SMM_INLINE int32_t GetBucketIndexImpl(void* _p)
     {
         if (!IsMyAlloc(_p))
         {
             return -1;
         }
 
-        size_t bucketIndex = FindBucket(_p);
-        if (bucketIndex >= bucketsCount)
+        size_t bucketIndex = TGeometry::FindBucket(this, _p);
+        if (bucketIndex >= TGeometry::GetBucketsCount(this))
         {
             return -1;
         }
@@ -808,19 +1623,73 @@ class Allocator
         return (int32_t)bucketIndex;
     }
 
-    SMM_INLINE bool IsMyAlloc(const void* p) const { return (p >= pBuffer.get() && p < pBufferEnd); }
+  public:
+    Allocator(GenericAllocator::TInstance allocator);
+    ~Allocator();
+
+    Allocator(const Allocator&) = delete;
+    Allocator& operator=(const Allocator&) = delete;
+
+    void Init(uint32_t bucketsCount, size_t bucketSizeInBytes, uint32_t flags = ALLOCATOR_DEFAULT);
+    // per bucket capacity (in bytes), the number of buckets is the size of the list
+    void Init(std::initializer_list<size_t> bucketsCapacityInBytes, uint32_t flags = ALLOCATOR_DEFAULT);
+
+    // return free pages of all buckets to the OS (virtual arena only, elements kept by thread caches are not released)
+    // returns number of released bytes
+    size_t Trim();
+
+    // effective allocator flags (features that are not supported by the system are dropped at initialization time)
+    SMM_INLINE uint32_t GetFlags() const { return flags; }
+
+    SMM_INLINE void* Alloc(size_t _bytesCount, size_t alignment)
+    {
+        return Allocate<true, RuntimeGeometry>(nullptr, _bytesCount, alignment);
+    }
+
+    SMM_INLINE void Free(void* p) { Deallocate<RuntimeGeometry>(nullptr, p); }
+
+    // allocate / free using an explicit thread cache (nullptr is the cache of the current thread)
+    SMM_INLINE void* Alloc(ThreadCache* cache, size_t _bytesCount, size_t alignment)
+    {
+        return Allocate<true, RuntimeGeometry>(cache, _bytesCount, alignment);
+    }
+
+    SMM_INLINE void Free(ThreadCache* cache, void* p) { Deallocate<RuntimeGeometry>(cache, p); }
+
+    // free using the size and alignment passed to Alloc (no pointer to bucket lookup)
+    SMM_INLINE void FreeSized(void* p, size_t bytesCount, size_t alignment)
+    {
+        DeallocateSized<RuntimeGeometry>(nullptr, p, bytesCount, alignment);
+    }
+
+    SMM_INLINE void* Realloc(void* p, size_t bytesCount, size_t alignment) { return Reallocate<RuntimeGeometry>(p, bytesCount, alignment); }
+
+    // allocate 'count' blocks of the same size, returns number of allocated blocks 'n' (out[0..n) are valid, the rest of 'out' is nullptr)
+    SMM_INLINE size_t AllocBatch(size_t bytesCount, size_t alignment, size_t count, void** out)
+    {
+        return AllocateBatch<true, RuntimeGeometry>(bytesCount, alignment, count, out);
+    }
+
+    // free 'count' blocks of any sizes
+    SMM_INLINE void FreeBatch(void** ptrs, size_t count) { DeallocateBatch<RuntimeGeometry>(ptrs, count); }
+
+    SMM_INLINE size_t GetUsableSize(void* p) { return GetUsableSizeImpl<RuntimeGeometry>(p); }
+
+    SMM_INLINE int32_t GetBucketIndex(void* _p) { return GetBucketIndexImpl<RuntimeGeometry>(_p); }
+
+    SMM_INLINE bool IsMyAlloc(const void* p) const { return (p >= pBuffer && p < pBufferEnd); }
 
     SMM_INLINE size_t GetBucketsCount() const { return bucketsCount; }
 
-    SMM_INLINE uint32_t GetBucketElementsCount(size_t bucketIndex) const
+    SMM_INLINE size_t GetBucketElementsCount(size_t bucketIndex) const
     {
         if (bucketIndex >= bucketsCount)
         {
             return 0;
         }
 
-        size_t oneElementSize = GetBucketSizeInBytesByIndex(bucketIndex);
-        return (uint32_t)(bucketSizeInBytes / oneElementSize);
+        const PoolBucket& bucket = buckets[bucketIndex];
+        return bucket.capacity.load(std::memory_order_relaxed) / bucket.elementSize;
     }
 
 #ifdef SMMALLOC_STATS_SUPPORT
@@ -847,21 +1716,32 @@ namespace internal
 struct TlsPoolBucket
 {
     uint8_t* pBucketData;           // 8 (4)
-    uint32_t* pStorageL1;           // 8 (4)
+    ElementOffset* pStorageL1;      // 8 (4)
     Allocator::PoolBucket* pBucket; // 8 (4)
 
-    std::array<uint32_t, SMM_MAX_CACHE_ITEMS_COUNT> storageL0; //
+    std::array<ElementOffset, SMM_MAX_CACHE_ITEMS_COUNT> storageL0; //
 
     uint32_t maxElementsCount; // 4
     uint32_t numElementsL1;    // 4
     uint8_t numElementsL0;     // 1
+    uint8_t isFlushing;        // 1
 
-    // sizeof(storageL0) + 33 bytes
+    // sizeof(storageL0) + 34 bytes
 
     SMM_INLINE uint32_t GetElementsCount() const { return numElementsL1 + numElementsL0; }
 
-    void Init(uint32_t* pCacheStack, uint32_t maxElementsNum, CacheWarmupOptions warmupOptions, Allocator* alloc, size_t bucketIndex);
-    uint32_t* Destroy();
+    void Init(ElementOffset* pCacheStack, uint32_t maxElementsNum, uint32_t capacity, CacheWarmupOptions warmupOptions, Allocator* alloc,
+              size_t bucketIndex);
+    ElementOffset* Destroy();
+
+    // cache is empty, take half of L1 capacity from master (detached as a single chain)
+    SMM_NOINLINE bool GetL1CacheFromMaster();
+
+    // return cached elements above 'keepCount' to master (L0 is emptied as well if 'keepCount' is zero)
+    void Flush(uint32_t keepCount);
+
+    // incremental flush in progress, return the next chunk (stops once L1 is down to half of its capacity)
+    SMM_NOINLINE void FlushStep();
 
     SMM_INLINE void ReturnL1CacheToMaster(uint32_t count)
     {
@@ -878,9 +1758,9 @@ struct TlsPoolBucket
 
         count = std::min(count, numElementsL1);
 
-        uint32_t localTag = 0xFFFFFF;
+        ElementOffset localTag = 0xFFFFFF;
         uint32_t firstElementToReturn = (numElementsL1 - count);
-        uint32_t offset = pStorageL1[firstElementToReturn];
+        ElementOffset offset = pStorageL1[firstElementToReturn];
         uint8_t* pHead = pBucketData + offset;
         uint8_t* pPrevBlockMemory = pHead;
 
@@ -897,7 +1777,7 @@ struct TlsPoolBucket
         }
 
         uint8_t* pTail = pPrevBlockMemory;
-        pBucket->FreeInterval(pHead, pTail);
+        pBucket->FreeChain(pHead, pTail);
 
         numElementsL1 -= count;
     }
@@ -905,15 +1785,82 @@ struct TlsPoolBucket
 
 static_assert(std::is_pod<TlsPoolBucket>::value == true, "TlsPoolBucket must be POD type, stored in TLS");
 static_assert(sizeof(TlsPoolBucket) <= 64, "TlsPoolBucket sizeof must be less than CPU cache line");
+
+// adaptive thread cache state of the bucket (touched only on refills and flushes)
+struct ThreadCacheFeedback
+{
+    // capacity passed to CreateThreadCache (size of the L1 storage)
+    uint32_t capacityLimit;
+    // value of ThreadCache::clock at the last refill or flush
+    uint32_t lastActivity;
+    // number of flushes since the last refill
+    uint32_t flushStreak;
+    // number of L1 elements moved to the stealable range (the owner's L1 stack starts right after them)
+    uint32_t publishedCount;
+    // start of the L1 storage (never changes, thieves read the stealable range from here)
+    ElementOffset* storageBase;
+    // version (high 32 bits) and number of elements left (low 32 bits) in the stealable range, thieves take elements from its
+    // end and keep the version, the owner bumps the version every time it takes the range back or publishes a new one
+    std::atomic<uint64_t> stealRange;
+};
+
+// thread cache of a single allocator (allocated from the allocator's generic allocator on the first use)
+struct ThreadCache
+{
+    std::array<TlsPoolBucket, SMM_MAX_BUCKET_COUNT> buckets;
+    std::array<ThreadCacheFeedback, SMM_MAX_BUCKET_COUNT> feedback;
+    Allocator* owner;
+    // sum of capacity * element size over all buckets and its limit (adaptive cache only)
+    size_t usedBytes;
+    size_t budgetBytes;
+    // number of refills and flushes of all buckets (used to find idle buckets)
+    uint32_t clock;
+    // last seen Allocator::scavengeEpoch
+    uint32_t scavengeEpoch;
+    // Allocator::cacheList links
+    ThreadCache* listPrev;
+    ThreadCache* listNext;
+};
+
+// thread cache of the current thread and the generation of the allocator's cache id it was created for
+struct TlsCacheSlot
+{
+    ThreadCache* cache;
+    uint32_t generation;
+};
+
+static_assert(SMM_MAX_THREAD_CACHES_COUNT > 0 && SMM_MAX_THREAD_CACHES_COUNT <= 64, "Thread cache ids are stored in 64-bit mask");
+
+SMM_INLINE TlsPoolBucket* GetCacheBucket(ThreadCache* cache, size_t index) { return &cache->buckets[index]; }
+
+#ifndef SMM_OUT_OF_LINE_TLS
+// defined in smmalloc_tls.cpp
+extern SMM_TLS_VARIABLE TlsCacheSlot tlsCaches[SMM_MAX_THREAD_CACHES_COUNT + 1];
+extern TlsPoolBucket emptyCacheBuckets[SMM_MAX_BUCKET_COUNT];
+#endif
 } // namespace internal
 
-SMM_INLINE void* Allocator::AllocFromCache(internal::TlsPoolBucket* __restrict _self) const
+#ifndef SMM_OUT_OF_LINE_TLS
+SMM_INLINE internal::TlsPoolBucket* GetTlsBucket(uint32_t cacheId, uint32_t cacheGeneration, size_t index)
+{
+    if (SM_UNLIKELY(index >= SMM_MAX_BUCKET_COUNT))
+    {
+        // unreachable (index < bucketsCount), keeps the bound visible to compilers (bucketsCount is only known at run time)
+        return &internal::emptyCacheBuckets[0];
+    }
+
+    const internal::TlsCacheSlot& slot = internal::tlsCaches[cacheId];
+    return (slot.cache && slot.generation == cacheGeneration) ? &slot.cache->buckets[index] : &internal::emptyCacheBuckets[index];
+}
+#endif
+
+SMM_INLINE void* Allocator::AllocFromCache(internal::TlsPoolBucket* __restrict _self)
 {
     if (_self->numElementsL0 > 0)
     {
         SM_ASSERT(_self->pBucketData != nullptr);
         _self->numElementsL0--;
-        uint32_t offset = _self->storageL0[_self->numElementsL0];
+        internal::ElementOffset offset = _self->storageL0[_self->numElementsL0];
         return _self->pBucketData + offset;
     }
 
@@ -922,13 +1869,53 @@ SMM_INLINE void* Allocator::AllocFromCache(internal::TlsPoolBucket* __restrict _
         SM_ASSERT(_self->pBucketData != nullptr);
         SM_ASSERT(_self->numElementsL0 == 0);
         _self->numElementsL1--;
-        uint32_t offset = _self->pStorageL1[_self->numElementsL1];
+        internal::ElementOffset offset = _self->pStorageL1[_self->numElementsL1];
+        return _self->pBucketData + offset;
+    }
+
+    if (_self->maxElementsCount == 0)
+    {
+        return nullptr;
+    }
+
+    // the slow path can refill L1 itself (elements taken back from the stealable range)
+    OnThreadCacheMiss(_self);
+    if (_self->numElementsL1 > 0 || _self->GetL1CacheFromMaster())
+    {
+        _self->numElementsL1--;
+        internal::ElementOffset offset = _self->pStorageL1[_self->numElementsL1];
         return _self->pBucketData + offset;
     }
     return nullptr;
 }
 
-template <bool useCacheL0> SMM_INLINE bool Allocator::ReleaseToCache(internal::TlsPoolBucket* __restrict _self, void* _p)
+SMM_INLINE size_t Allocator::AllocBatchFromCache(internal::TlsPoolBucket* __restrict _self, size_t count, void** out)
+{
+    if (_self->maxElementsCount == 0)
+    {
+        // empty cache bucket (shared by all threads without a cache, never written)
+        return 0;
+    }
+
+    size_t doneCount = 0;
+    while (doneCount < count && _self->numElementsL0 > 0)
+    {
+        _self->numElementsL0--;
+        out[doneCount++] = _self->pBucketData + _self->storageL0[_self->numElementsL0];
+    }
+
+    uint32_t takeCount = uint32_t(Min(count - doneCount, _self->numElementsL1));
+    const internal::ElementOffset* pOffsets = _self->pStorageL1 + (_self->numElementsL1 - takeCount);
+    _self->numElementsL1 -= takeCount;
+    for (uint32_t i = 0; i < takeCount; i++)
+    {
+        out[doneCount++] = _self->pBucketData + pOffsets[i];
+    }
+    return doneCount;
+}
+
+template <bool useCacheL0, bool allowFlush>
+SMM_INLINE bool Allocator::ReleaseToCache(internal::TlsPoolBucket* __restrict _self, void* _p)
 {
 
     if (_self->maxElementsCount == 0)
@@ -943,7 +1930,7 @@ template <bool useCacheL0> SMM_INLINE bool Allocator::ReleaseToCache(internal::T
     // get offset
     uint8_t* p = (uint8_t*)_p;
     SM_ASSERT(p >= _self->pBucketData && p < _self->pBucket->pBufferEnd);
-    uint32_t offset = (uint32_t)(p - _self->pBucketData);
+    internal::ElementOffset offset = (internal::ElementOffset)(p - _self->pBucketData);
 
     if (useCacheL0)
     {
@@ -958,19 +1945,34 @@ template <bool useCacheL0> SMM_INLINE bool Allocator::ReleaseToCache(internal::T
 
     if (_self->numElementsL1 < _self->maxElementsCount)
     {
+        if (allowFlush && _self->isFlushing)
+        {
+            // cache overflowed recently, spread the rest of the flush over the next frees (see ALLOCATOR_INCREMENTAL_FLUSH)
+            _self->FlushStep();
+        }
+
         // use L1 storage if available
         _self->pStorageL1[_self->numElementsL1] = offset;
         _self->numElementsL1++;
         return true;
     }
 
+    if (!allowFlush)
+    {
+        return false;
+    }
+
     //
     // too many elements in cache (return half of the cache to master)
     //    minimizing worst case scenario, cache is full and thread continues to Free a lot of blocks.
     //               and each Free() call leads to an operation with the global lock-free pool
 
-    uint32_t halfOfElements = (_self->numElementsL1 >> 1);
-    _self->ReturnL1CacheToMaster(halfOfElements);
+    OnThreadCacheOverflow(_self);
+    if (_self->numElementsL1 >= _self->maxElementsCount)
+    {
+        // cache is still above its (just reduced) capacity, the rest is returned by the next overflows
+        return false;
+    }
 
     // use L1 storage
     _self->pStorageL1[_self->numElementsL1] = offset;
@@ -978,6 +1980,135 @@ template <bool useCacheL0> SMM_INLINE bool Allocator::ReleaseToCache(internal::T
     return true;
 }
 
+/*
+    Allocator with the compile-time geometry (bucket count, power of two bucket stride and partitioning scheme)
+
+    struct MyConfig
+    {
+        typedef sm::LinearPartitioning Partitioning;
+        static const size_t kBucketsCount = 8;
+        static const uint32_t kBucketSizeShift = 24; // 16Mb per bucket
+        static const uint32_t kFlags = sm::ALLOCATOR_DEFAULT;
+    };
+
+    sm::StaticAllocator<MyConfig> heap;
+
+    Pointer to bucket mapping is a single shift and all the bucket bounds checks are compile-time constants.
+    Allocators with different partitioning schemes can coexist in one binary, that is why StaticAllocator is not convertible to
+    sm::Allocator (runtime allocator always uses the default partitioning).
+*/
+template <typename TConfig> class StaticAllocator : protected Allocator
+{
+    typedef typename TConfig::Partitioning Partitioning;
+    static const size_t kBucketsCount = TConfig::kBucketsCount;
+    static const uint32_t kBucketSizeShift = TConfig::kBucketSizeShift;
+
+    static_assert(kBucketsCount > 0 && kBucketsCount <= SMM_MAX_BUCKET_COUNT, "Invalid buckets count");
+#ifdef SMM_WIDE_OFFSETS
+    static_assert(kBucketSizeShift >= 12 && kBucketSizeShift < 47, "Bucket size must be in [4Kb, 128Tb) range");
+#else
+    static_assert(kBucketSizeShift >= 12 && kBucketSizeShift < 32, "Bucket size must be in [4Kb, 4Gb) range");
+#endif
+    static_assert((TConfig::kFlags & ALLOCATOR_GROWABLE_BUCKETS) == 0, "Growable buckets have variable stride");
+    static_assert((TConfig::kFlags & ALLOCATOR_HUGE_PAGES) == 0 || kBucketSizeShift >= 21, "Bucket size must be a multiple of huge page size");
+
+    struct StaticGeometry
+    {
+        static SMM_INLINE size_t GetBucketIndexBySize(size_t bytesCount) { return Partitioning::GetBucketIndexBySize(bytesCount); }
+        static SMM_INLINE size_t GetBucketSizeInBytesByIndex(size_t bucketIndex) { return Partitioning::GetBucketSizeInBytesByIndex(bucketIndex); }
+        static SMM_INLINE size_t GetBucketsCount(const Allocator*) { return kBucketsCount; }
+        static SMM_INLINE size_t FindBucket(const Allocator* allocator, const void* p)
+        {
+            return size_t(((uintptr_t)p - (uintptr_t)allocator->pBuffer) >> kBucketSizeShift);
+        }
+    };
+
+  public:
+    explicit StaticAllocator(GenericAllocator::TInstance allocator = nullptr)
+        : Allocator(allocator)
+    {
+        std::array<size_t, SMM_MAX_BUCKET_COUNT> bucketsCapacity;
+        std::array<size_t, SMM_MAX_BUCKET_COUNT> bucketsElementSize;
+        for (size_t i = 0; i < kBucketsCount; i++)
+        {
+            bucketsCapacity[i] = (size_t(1) << kBucketSizeShift);
+            bucketsElementSize[i] = Partitioning::GetBucketSizeInBytesByIndex(i);
+        }
+        InitBuckets(bucketsCapacity.data(), bucketsElementSize.data(), kBucketsCount, TConfig::kFlags);
+        SM_ASSERT(bucketsCount == kBucketsCount);
+        SM_ASSERT(buckets[kBucketsCount - 1].pData == (pBuffer + ((kBucketsCount - 1) << kBucketSizeShift)) && "Unexpected layout");
+    }
+
+    using Allocator::CreateThreadCache;
+    using Allocator::DestroyThreadCache;
+    using Allocator::SetAutoThreadCache;
+    using Allocator::FlushThreadCache;
+    using Allocator::CreateCache;
+    using Allocator::DestroyCache;
+    using Allocator::Scavenge;
+    using Allocator::GetBucketElementsCount;
+    using Allocator::GetBucketsCount;
+    using Allocator::GetFlags;
+    using Allocator::IsMyAlloc;
+    using Allocator::Trim;
+#ifdef SMMALLOC_STATS_SUPPORT
+    using Allocator::GetBucketStats;
+    using Allocator::GetGlobalStats;
+#endif
+
+    SMM_INLINE void* Alloc(size_t _bytesCount, size_t alignment) { return Allocate<true, StaticGeometry>(nullptr, _bytesCount, alignment); }
+
+    SMM_INLINE void Free(void* p) { Deallocate<StaticGeometry>(nullptr, p); }
+
+    SMM_INLINE void* Alloc(ThreadCache* cache, size_t _bytesCount, size_t alignment)
+    {
+        return Allocate<true, StaticGeometry>(cache, _bytesCount, alignment);
+    }
+
+    SMM_INLINE void Free(ThreadCache* cache, void* p) { Deallocate<StaticGeometry>(cache, p); }
+
+    SMM_INLINE void FreeSized(void* p, size_t bytesCount, size_t alignment)
+    {
+        DeallocateSized<StaticGeometry>(nullptr, p, bytesCount, alignment);
+    }
+
+    SMM_INLINE void* Realloc(void* p, size_t bytesCount, size_t alignment) { return Reallocate<StaticGeometry>(p, bytesCount, alignment); }
+
+    SMM_INLINE size_t AllocBatch(size_t bytesCount, size_t alignment, size_t count, void** out)
+    {
+        return AllocateBatch<true, StaticGeometry>(bytesCount, alignment, count, out);
+    }
+
+    SMM_INLINE void FreeBatch(void** ptrs, size_t count) { DeallocateBatch<StaticGeometry>(ptrs, count); }
+
+    SMM_INLINE size_t GetUsableSize(void* p) { return GetUsableSizeImpl<StaticGeometry>(p); }
+
+    SMM_INLINE int32_t GetBucketIndex(void* _p) { return GetBucketIndexImpl<StaticGeometry>(_p); }
+
+    static SMM_INLINE size_t GetBucketSizeInBytesByIndex(size_t bucketIndex) { return Partitioning::GetBucketSizeInBytesByIndex(bucketIndex); }
+};
+
+namespace internal
+{
+// allocate and construct allocator object (memory comes from the given fallback backend)
+SMM_INLINE Allocator* CreateAllocator(const GenericAllocator::Backend* backend)
+{
+    GenericAllocator::TInstance instance = GenericAllocator::Create(backend);
+    if (!GenericAllocator::IsValid(instance))
+    {
+        return nullptr;
+    }
+
+    size_t align = __alignof(Allocator);
+    align = Align(align, SMM_CACHE_LINE_SIZE);
+
+    void* pBuffer = GenericAllocator::Alloc(instance, sizeof(Allocator), align);
+
+    // placement new
+    return new (pBuffer) Allocator(instance);
+}
+} // namespace internal
+
 } // namespace sm
 
 #undef SMM_MANTISSA_BITS
@@ -1007,26 +2138,38 @@ extern "C"
     ////////////////////////////////////////////////////////////////////////////////
 
     typedef sm::Allocator* sm_allocator;
+    typedef sm::ThreadCache* sm_thread_cache;
 
-    SMMALLOC_API SMM_INLINE sm_allocator _sm_allocator_create(uint32_t bucketsCount, size_t bucketSizeInBytes)
+    // backend is used for allocations that can't be served by buckets (must outlive the allocator, nullptr = std::malloc)
+    SMMALLOC_API SMM_INLINE sm_allocator _sm_allocator_create(uint32_t bucketsCount, size_t bucketSizeInBytes,
+                                                              uint32_t flags = sm::ALLOCATOR_DEFAULT,
+                                                              const sm::GenericAllocator::Backend* backend = nullptr)
     {
-        sm::GenericAllocator::TInstance instance = sm::GenericAllocator::Create();
-        if (!sm::GenericAllocator::IsValid(instance))
+        sm::Allocator* allocator = sm::internal::CreateAllocator(backend);
+        if (allocator == nullptr)
         {
             return nullptr;
         }
 
-        // allocate memory for an allocator
-        size_t align = __alignof(sm::Allocator);
-        align = sm::Align(align, SMM_CACHE_LINE_SIZE);
+        // initialize
+        allocator->Init(bucketsCount, bucketSizeInBytes, flags);
 
-        void* pBuffer = sm::GenericAllocator::Alloc(instance, sizeof(sm::Allocator), align);
+        return allocator;
+    }
 
-        // placement new
-        sm::Allocator* allocator = new (pBuffer) sm::Allocator(instance);
+    // create allocator with per bucket capacities (in bytes)
+    SMMALLOC_API SMM_INLINE sm_allocator _sm_allocator_create_ex(std::initializer_list<size_t> bucketsCapacityInBytes,
+                                                                 uint32_t flags = sm::ALLOCATOR_DEFAULT,
+                                                                 const sm::GenericAllocator::Backend* backend = nullptr)
+    {
+        sm::Allocator* allocator = sm::internal::CreateAllocator(backend);
+        if (allocator == nullptr)
+        {
+            return nullptr;
+        }
 
         // initialize
-        allocator->Init(bucketsCount, bucketSizeInBytes);
+        allocator->Init(bucketsCapacityInBytes, flags);
 
         return allocator;
     }
@@ -1071,6 +2214,65 @@ extern "C"
         allocator->DestroyThreadCache();
     }
 
+    SMMALLOC_API SMM_INLINE void _sm_allocator_thread_cache_auto(sm_allocator allocator, sm::CacheWarmupOptions warmupOptions,
+                                                                 std::initializer_list<uint32_t> options)
+    {
+        if (allocator == nullptr)
+        {
+            return;
+        }
+
+        allocator->SetAutoThreadCache(warmupOptions, options);
+    }
+
+    SMMALLOC_API SMM_INLINE void _sm_allocator_thread_cache_flush(sm_allocator allocator)
+    {
+        if (allocator == nullptr)
+        {
+            return;
+        }
+
+        allocator->FlushThreadCache();
+    }
+
+    SMMALLOC_API SMM_INLINE void _sm_allocator_scavenge(sm_allocator allocator)
+    {
+        if (allocator == nullptr)
+        {
+            return;
+        }
+
+        allocator->Scavenge();
+    }
+
+    SMMALLOC_API SMM_INLINE sm_thread_cache _sm_thread_cache_create(sm_allocator allocator, sm::CacheWarmupOptions warmupOptions,
+                                                                    std::initializer_list<uint32_t> options)
+    {
+        if (allocator == nullptr)
+        {
+            return nullptr;
+        }
+
+        return allocator->CreateCache(warmupOptions, options);
+    }
+
+    SMMALLOC_API SMM_INLINE void _sm_thread_cache_destroy(sm_allocator allocator, sm_thread_cache cache)
+    {
+        if (allocator == nullptr)
+        {
+            return;
+        }
+
+        allocator->DestroyCache(cache);
+    }
+
+    SMMALLOC_API SMM_INLINE void* _sm_malloc_cache(sm_allocator allocator, sm_thread_cache cache, size_t bytesCount, size_t alignment)
+    {
+        return allocator->Alloc(cache, bytesCount, alignment);
+    }
+
+    SMMALLOC_API SMM_INLINE void _sm_free_cache(sm_allocator allocator, sm_thread_cache cache, void* p) { return allocator->Free(cache, p); }
+
     SMMALLOC_API SMM_INLINE void* _sm_malloc(sm_allocator allocator, size_t bytesCount, size_t alignment)
     {
         return allocator->Alloc(bytesCount, alignment);
@@ -1078,6 +2280,21 @@ extern "C"
 
     SMMALLOC_API SMM_INLINE void _sm_free(sm_allocator allocator, void* p) { return allocator->Free(p); }
 
+    // free memory block allocated with the given size and alignment (e.g. C++14 sized delete)
+    SMMALLOC_API SMM_INLINE void _sm_free_sized(sm_allocator allocator, void* p, size_t bytesCount, size_t alignment)
+    {
+        allocator->FreeSized(p, bytesCount, alignment);
+    }
+
+    // allocate 'count' blocks of the same size into 'out', returns number of allocated blocks (first entries of 'out', the rest is nullptr)
+    SMMALLOC_API SMM_INLINE size_t _sm_malloc_batch(sm_allocator allocator, size_t bytesCount, size_t alignment, size_t count, void** out)
+    {
+        return allocator->AllocBatch(bytesCount, alignment, count, out);
+    }
+
+    // free 'count' blocks (pointers of all sizes can be mixed)
+    SMMALLOC_API SMM_INLINE void _sm_free_batch(sm_allocator allocator, void** ptrs, size_t count) { allocator->FreeBatch(ptrs, count); }
+
     SMMALLOC_API SMM_INLINE void* _sm_realloc(sm_allocator allocator, void* p, size_t bytesCount, size_t alignment)
     {
         return allocator->Realloc(p, bytesCount, alignment);
@@ -1087,6 +2304,16 @@ extern "C"
 
     SMMALLOC_API SMM_INLINE int32_t _sm_mbucket(sm_allocator allocator, void* p) { return allocator->GetBucketIndex(p); }
 
+    SMMALLOC_API SMM_INLINE size_t _sm_allocator_trim(sm_allocator allocator)
+    {
+        if (allocator == nullptr)
+        {
+            return 0;
+        }
+
+        return allocator->Trim();
+    }
+
 #ifdef __cplusplus
 }
 #endif
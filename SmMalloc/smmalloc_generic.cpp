@@ -19,42 +19,283 @@
 // 	LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
 // 	OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
 // 	THE SOFTWARE.
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+// mremap
+#define _GNU_SOURCE
+#endif
+
 #include "smmalloc.h"
 #include <stdlib.h>
 
+#if !defined(_WIN32)
+#include <sys/mman.h>
+#define SMM_LARGE_OBJECTS_SUPPORT
+#endif
+
+// default backend maps blocks of this size (header included) and bigger directly from the OS (same as glibc mmap threshold)
+#ifndef SMM_LARGE_OBJECT_MIN_SIZE
+#define SMM_LARGE_OBJECT_MIN_SIZE (128 * 1024)
+#endif
+
+// number of recently freed large spans kept for reuse (per shard)
+#ifndef SMM_LARGE_SPAN_CACHE_COUNT
+#define SMM_LARGE_SPAN_CACHE_COUNT (16)
+#endif
+
+// max number of bytes kept in the large span cache (all shards)
+#ifndef SMM_LARGE_SPAN_CACHE_SIZE
+#define SMM_LARGE_SPAN_CACHE_SIZE (64 * 1024 * 1024)
+#endif
+
+// number of large span cache shards (threads free to their home shard and look into the others before mapping a new span)
+#ifndef SMM_LARGE_SPAN_CACHE_SHARDS_COUNT
+#define SMM_LARGE_SPAN_CACHE_SHARDS_COUNT (8)
+#endif
+
 struct Header
 {
     void* p;
     size_t size;
 };
 
+#ifdef SMM_LARGE_OBJECTS_SUPPORT
+
+/*
+    Large object layout (span is page aligned)
+
+    [mapped bytes count][padding][Header][user data ...]
+
+    Header::p points to the span start, the lowest bit is set to distinguish large objects from malloc blocks.
+*/
+namespace
+{
+const uintptr_t kLargeObjectTag = 1;
+
+struct LargeSpan
+{
+    void* p;
+    size_t bytesCount;
+};
+
+struct alignas(SMM_CACHE_LINE_SIZE) LargeSpanCache
+{
+    sm::internal::SpinLock lock;
+    size_t count;
+    size_t bytesCount;
+    LargeSpan spans[SMM_LARGE_SPAN_CACHE_COUNT];
+};
+
+static_assert(SMM_LARGE_SPAN_CACHE_SHARDS_COUNT > 0 && (SMM_LARGE_SPAN_CACHE_SHARDS_COUNT & (SMM_LARGE_SPAN_CACHE_SHARDS_COUNT - 1)) == 0,
+              "Shards count must be power of two");
+
+// zero initialized (no dynamic initialization order issues)
+LargeSpanCache gLargeSpanCaches[SMM_LARGE_SPAN_CACHE_SHARDS_COUNT];
+
+SMM_INLINE uint32_t GetLargeSpanCacheHomeShard() { return sm::GetTlsShardIndex() & (SMM_LARGE_SPAN_CACHE_SHARDS_COUNT - 1); }
+
+// take the best fitting span of the shard (don't waste more than a half of the span), returns nullptr if there is no such span
+void* TakeCachedSpan(LargeSpanCache& cache, size_t bytesCount)
+{
+    sm::internal::SpinLockGuard lock(cache.lock);
+    size_t bestIndex = SIZE_MAX;
+    for (size_t i = 0; i < cache.count; i++)
+    {
+        size_t spanBytesCount = cache.spans[i].bytesCount;
+        if (spanBytesCount >= bytesCount && spanBytesCount <= bytesCount * 2 &&
+            (bestIndex == SIZE_MAX || spanBytesCount < cache.spans[bestIndex].bytesCount))
+        {
+            bestIndex = i;
+        }
+    }
+
+    if (bestIndex == SIZE_MAX)
+    {
+        return nullptr;
+    }
+
+    LargeSpan span = cache.spans[bestIndex];
+    cache.count--;
+    cache.spans[bestIndex] = cache.spans[cache.count];
+    cache.bytesCount -= span.bytesCount;
+    *((size_t*)span.p) = span.bytesCount;
+    return span.p;
+}
+
+SMM_INLINE bool IsLargeObject(const Header* h) { return (uintptr_t(h->p) & kLargeObjectTag) != 0; }
+
+SMM_INLINE uint8_t* GetLargeSpan(const Header* h) { return (uint8_t*)(uintptr_t(h->p) & ~kLargeObjectTag); }
+
+SMM_INLINE size_t GetLargeObjectOffset(size_t alignment) { return sm::Align(sizeof(size_t) + sizeof(Header), std::max(alignment, alignof(Header))); }
+
+// threshold is applied to the mapped size (header included), so the page rounding waste is always small compared to the span
+SMM_INLINE bool IsLargeObjectSize(size_t bytesCount, size_t alignment)
+{
+    return (GetLargeObjectOffset(alignment) + bytesCount) >= SMM_LARGE_OBJECT_MIN_SIZE;
+}
+
+void* MapLargeSpan(size_t bytesCount)
+{
+    // try to reuse recently freed span, home shard first (a syscall is much more expensive than looking into the other shards)
+    uint32_t homeShardIndex = GetLargeSpanCacheHomeShard();
+    for (uint32_t i = 0; i < SMM_LARGE_SPAN_CACHE_SHARDS_COUNT; i++)
+    {
+        LargeSpanCache& cache = gLargeSpanCaches[(homeShardIndex + i) & (SMM_LARGE_SPAN_CACHE_SHARDS_COUNT - 1)];
+        if (cache.count == 0)
+        {
+            continue;
+        }
+
+        void* p = TakeCachedSpan(cache, bytesCount);
+        if (p)
+        {
+            return p;
+        }
+    }
+
+    void* p = mmap(nullptr, bytesCount, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED)
+    {
+        return nullptr;
+    }
+    *((size_t*)p) = bytesCount;
+    return p;
+}
+
+void UnmapLargeSpan(void* p)
+{
+    size_t bytesCount = *((size_t*)p);
+    {
+        LargeSpanCache& cache = gLargeSpanCaches[GetLargeSpanCacheHomeShard()];
+        sm::internal::SpinLockGuard lock(cache.lock);
+        const size_t kShardMaxBytesCount = SMM_LARGE_SPAN_CACHE_SIZE / SMM_LARGE_SPAN_CACHE_SHARDS_COUNT;
+        if (cache.count < SMM_LARGE_SPAN_CACHE_COUNT && (cache.bytesCount + bytesCount) <= kShardMaxBytesCount)
+        {
+            LargeSpan& span = cache.spans[cache.count];
+            span.p = p;
+            span.bytesCount = bytesCount;
+            cache.count++;
+            cache.bytesCount += bytesCount;
+            return;
+        }
+    }
+
+    munmap(p, bytesCount);
+}
+
+void* AllocLarge(size_t bytesCount, size_t alignment)
+{
+    SM_ASSERT(alignment <= sm::VirtualMemory::GetPageSize());
+    size_t offset = GetLargeObjectOffset(alignment);
+    uint8_t* span = (uint8_t*)MapLargeSpan(sm::Align(offset + bytesCount, sm::VirtualMemory::GetPageSize()));
+    if (span == nullptr)
+    {
+        return nullptr;
+    }
+
+    uint8_t* p = span + offset;
+    Header* h = reinterpret_cast<Header*>(p - sizeof(Header));
+    h->p = (void*)(uintptr_t(span) | kLargeObjectTag);
+    h->size = bytesCount;
+    return p;
+}
+
+// try to resize large object without copying memory, returns nullptr if not possible
+void* ReallocLarge(void* p, size_t bytesCount, size_t alignment)
+{
+    Header* h = reinterpret_cast<Header*>(reinterpret_cast<char*>(p) - sizeof(Header));
+    uint8_t* span = GetLargeSpan(h);
+    size_t offset = size_t((uint8_t*)p - span);
+    if (!sm::IsAligned(offset, alignment))
+    {
+        return nullptr;
+    }
+
+    size_t spanBytesCount = *((size_t*)span);
+    size_t newSpanBytesCount = sm::Align(offset + bytesCount, sm::VirtualMemory::GetPageSize());
+    if (newSpanBytesCount <= spanBytesCount)
+    {
+        // fits into the existing span
+        h->size = bytesCount;
+        return p;
+    }
+
+#if defined(MREMAP_MAYMOVE)
+    // grow (or move) the mapping, page table entries are moved instead of copying the memory
+    uint8_t* newSpan = (uint8_t*)mremap(span, spanBytesCount, newSpanBytesCount, MREMAP_MAYMOVE);
+    if (newSpan == (uint8_t*)MAP_FAILED)
+    {
+        return nullptr;
+    }
+
+    *((size_t*)newSpan) = newSpanBytesCount;
+    uint8_t* newP = newSpan + offset;
+    h = reinterpret_cast<Header*>(newP - sizeof(Header));
+    h->p = (void*)(uintptr_t(newSpan) | kLargeObjectTag);
+    h->size = bytesCount;
+    return newP;
+#else
+    return nullptr;
+#endif
+}
+
+} // namespace
+
+#endif
+
 sm::GenericAllocator::TInstance sm::GenericAllocator::Invalid() { return nullptr; }
 
 bool sm::GenericAllocator::IsValid(TInstance instance)
 {
-    SMMALLOC_UNUSED(instance);
-    return true;
+    // nullptr is the default backend
+    return (instance == nullptr) || (instance->alloc != nullptr && instance->free != nullptr);
 }
 
-sm::GenericAllocator::TInstance sm::GenericAllocator::Create() { return nullptr; }
+sm::GenericAllocator::TInstance sm::GenericAllocator::Create(const Backend* backend) { return backend; }
 
 void sm::GenericAllocator::Destroy(sm::GenericAllocator::TInstance instance) { SMMALLOC_UNUSED(instance); }
 
 void* sm::GenericAllocator::Alloc(sm::GenericAllocator::TInstance instance, size_t bytesCount, size_t alignment)
 {
-    SMMALLOC_UNUSED(instance);
     if (alignment < sm::Allocator::kMinValidAlignment)
     {
         alignment = sm::Allocator::kMinValidAlignment;
     }
+
+    if (instance && instance->usableSize)
+    {
+        // backend keeps track of sizes, no header required
+        return instance->alloc(instance->context, bytesCount, alignment);
+    }
+
+#ifdef SMM_LARGE_OBJECTS_SUPPORT
+    if (instance == nullptr && IsLargeObjectSize(bytesCount, alignment))
+    {
+        return AllocLarge(bytesCount, alignment);
+    }
+#endif
+
     void* p;
     void** p2;
-    size_t offset = alignment - 1 + sizeof(Header);
-    if ((p = (void*)std::malloc(bytesCount + offset)) == NULL)
+    if (instance)
     {
-        return NULL;
+        // let the backend align the block, header is stored in the padding in front of it
+        alignment = std::max(alignment, alignof(Header));
+        size_t offset = sm::Align(sizeof(Header), alignment);
+        if ((p = instance->alloc(instance->context, bytesCount + offset, alignment)) == NULL)
+        {
+            return NULL;
+        }
+        p2 = (void**)((size_t)(p) + offset);
+    }
+    else
+    {
+        size_t offset = alignment - 1 + sizeof(Header);
+        if ((p = (void*)std::malloc(bytesCount + offset)) == NULL)
+        {
+            return NULL;
+        }
+        p2 = (void**)(((size_t)(p) + offset) & ~(alignment - 1));
     }
-    p2 = (void**)(((size_t)(p) + offset) & ~(alignment - 1));
 
     Header* h = reinterpret_cast<Header*>(reinterpret_cast<char*>(p2) - sizeof(Header));
     h->p = p;
@@ -64,18 +305,61 @@ void* sm::GenericAllocator::Alloc(sm::GenericAllocator::TInstance instance, size
 
 void sm::GenericAllocator::Free(sm::GenericAllocator::TInstance instance, void* p)
 {
-    SMMALLOC_UNUSED(instance);
     if (!p)
     {
         return;
     }
+
+    if (instance && instance->usableSize)
+    {
+        instance->free(instance->context, p);
+        return;
+    }
+
     Header* h = reinterpret_cast<Header*>(reinterpret_cast<char*>(p) - sizeof(Header));
+    if (instance)
+    {
+        instance->free(instance->context, h->p);
+        return;
+    }
+
+#ifdef SMM_LARGE_OBJECTS_SUPPORT
+    if (IsLargeObject(h))
+    {
+        UnmapLargeSpan(GetLargeSpan(h));
+        return;
+    }
+#endif
     std::free(h->p);
 }
 
 void* sm::GenericAllocator::Realloc(sm::GenericAllocator::TInstance instance, void* p, size_t bytesCount, size_t alignment)
 {
-    SMMALLOC_UNUSED(instance);
+    if (instance && instance->usableSize && instance->realloc)
+    {
+        if (alignment < sm::Allocator::kMinValidAlignment)
+        {
+            alignment = sm::Allocator::kMinValidAlignment;
+        }
+        return instance->realloc(instance->context, p, bytesCount, alignment);
+    }
+
+#ifdef SMM_LARGE_OBJECTS_SUPPORT
+    if (instance == nullptr && p && IsLargeObjectSize(bytesCount, alignment) &&
+        IsLargeObject(reinterpret_cast<Header*>(reinterpret_cast<char*>(p) - sizeof(Header))))
+    {
+        if (alignment < sm::Allocator::kMinValidAlignment)
+        {
+            alignment = sm::Allocator::kMinValidAlignment;
+        }
+
+        void* p2 = ReallocLarge(p, bytesCount, alignment);
+        if (p2)
+        {
+            return p2;
+        }
+    }
+#endif
 
     void* p2 = Alloc(instance, bytesCount, alignment);
     if (!p2)
@@ -97,13 +381,16 @@ void* sm::GenericAllocator::Realloc(sm::GenericAllocator::TInstance instance, vo
 
 size_t sm::GenericAllocator::GetUsableSpace(sm::GenericAllocator::TInstance instance, void* p)
 {
-    SMMALLOC_UNUSED(instance);
-
     if (!p)
     {
         return 0;
     }
 
+    if (instance && instance->usableSize)
+    {
+        return instance->usableSize(instance->context, p);
+    }
+
     Header* h = reinterpret_cast<Header*>(reinterpret_cast<char*>(p) - sizeof(Header));
     return h->size;
 }
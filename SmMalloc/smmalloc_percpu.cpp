@@ -0,0 +1,450 @@
+// The MIT License (MIT)
+//
+// 	Copyright (c) 2017-2023 Sergey Makeev
+//
+// 	Permission is hereby granted, free of charge, to any person obtaining a copy
+// 	of this software and associated documentation files (the "Software"), to deal
+// 	in the Software without restriction, including without limitation the rights
+// 	to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// 	copies of the Software, and to permit persons to whom the Software is
+// 	furnished to do so, subject to the following conditions:
+//
+//      The above copyright notice and this permission notice shall be included in
+// 	all copies or substantial portions of the Software.
+//
+// 	THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// 	IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// 	FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// 	AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// 	LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// 	OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// 	THE SOFTWARE.
+#include "smmalloc.h"
+
+#ifdef SMM_PER_CPU_CACHE_SUPPORT
+
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#ifndef __NR_rseq
+#define __NR_rseq 334
+#endif
+
+// glibc 2.35+ registers a rseq area for every thread, the area is located at thread pointer + __rseq_offset
+// (both symbols are weak to keep working with older C runtimes)
+extern "C"
+{
+    extern const ptrdiff_t __rseq_offset __attribute__((weak));
+    extern const unsigned int __rseq_size __attribute__((weak));
+}
+
+namespace
+{
+
+// signature that precedes abort handlers (must match the one used by the C runtime, see RSEQ_SIG)
+const uint32_t kRseqSignature = 0x53053053;
+
+// kernel ABI (struct rseq)
+struct alignas(32) RseqArea
+{
+    uint32_t cpuIdStart;
+    uint32_t cpuId;
+    uint64_t rseqCs;
+    uint32_t flags;
+    uint32_t padding[3];
+};
+
+// used if the C runtime doesn't register rseq area by itself
+thread_local RseqArea tlsRseqArea = {0, UINT32_MAX, 0, 0, {0, 0, 0}};
+thread_local RseqArea* tlsRseq = nullptr;
+thread_local bool tlsRseqUnavailable = false;
+
+SMM_NOINLINE RseqArea* RegisterRseq()
+{
+    if (tlsRseqUnavailable)
+    {
+        return nullptr;
+    }
+
+    if (&__rseq_size != nullptr && __rseq_size > 0)
+    {
+        uintptr_t threadPointer;
+        __asm__("movq %%fs:0, %0" : "=r"(threadPointer));
+        tlsRseq = (RseqArea*)(threadPointer + __rseq_offset);
+        return tlsRseq;
+    }
+
+    if (syscall(__NR_rseq, &tlsRseqArea, sizeof(RseqArea), 0, kRseqSignature) == 0)
+    {
+        tlsRseq = &tlsRseqArea;
+        return tlsRseq;
+    }
+
+    tlsRseqUnavailable = true;
+    return nullptr;
+}
+
+SMM_INLINE RseqArea* GetRseq()
+{
+    RseqArea* rs = tlsRseq;
+    if (SM_LIKELY(rs != nullptr))
+    {
+        return rs;
+    }
+    return RegisterRseq();
+}
+
+//
+// Restartable sequences. The kernel restarts a sequence (jumps to the abort handler) if the thread is preempted, migrated or
+// signaled before the final (commit) store, so the per CPU stack is always modified by the CPU that owns it.
+//
+// Per CPU stack layout: uint32_t count (padded to the size of ElementOffset), ElementOffset offsets[capacity]
+//
+
+#ifdef SMM_WIDE_OFFSETS
+#define SMM_RSEQ_OFFSET_SIZE "8"
+#define SMM_RSEQ_OFFSET_MOV "movq"
+#define SMM_RSEQ_OFFSET_REG(name) "%q[" name "]"
+#else
+#define SMM_RSEQ_OFFSET_SIZE "4"
+#define SMM_RSEQ_OFFSET_MOV "movl"
+#define SMM_RSEQ_OFFSET_REG(name) "%k[" name "]"
+#endif
+
+// pop element from the stack of the current CPU (returns nullptr if the stack is empty)
+SMM_INLINE void* RseqPop(RseqArea* rs, uint8_t* pStacks, uint64_t cpuStride, uint32_t cpusCount, uint8_t* pData)
+{
+    uint64_t pStack;
+    uint64_t count;
+    uint64_t result;
+    __asm__ __volatile__(".pushsection __rseq_cs, \"aw\"\n\t"
+                         ".balign 32\n\t"
+                         "3:\n\t"
+                         ".long 0, 0\n\t"
+                         ".quad 1f, 2f - 1f, 4f\n\t"
+                         ".popsection\n\t"
+                         "0:\n\t"
+                         "leaq 3b(%%rip), %[pStack]\n\t"
+                         "movq %[pStack], 8(%[rs])\n\t"
+                         "1:\n\t"
+                         "xorl %k[result], %k[result]\n\t"
+                         "movl 4(%[rs]), %k[pStack]\n\t"
+                         "cmpl %[cpusCount], %k[pStack]\n\t"
+                         "jae 2f\n\t"
+                         "imulq %[cpuStride], %[pStack]\n\t"
+                         "addq %[pStacks], %[pStack]\n\t"
+                         "movl (%[pStack]), %k[count]\n\t"
+                         "testl %k[count], %k[count]\n\t"
+                         "jz 2f\n\t"
+                         SMM_RSEQ_OFFSET_MOV " (%[pStack], %[count], " SMM_RSEQ_OFFSET_SIZE "), " SMM_RSEQ_OFFSET_REG("result") "\n\t"
+                         "addq %[pData], %[result]\n\t"
+                         "subl $1, %k[count]\n\t"
+                         "movl %k[count], (%[pStack])\n\t"
+                         "2:\n\t"
+                         ".pushsection __rseq_failure, \"ax\"\n\t"
+                         ".byte 0x0f, 0xb9, 0x3d\n\t"
+                         ".long 0x53053053\n\t"
+                         "4:\n\t"
+                         "jmp 0b\n\t"
+                         ".popsection\n\t"
+                         : [pStack] "=&r"(pStack), [count] "=&r"(count), [result] "=&r"(result)
+                         : [rs] "r"(rs), [pStacks] "r"(pStacks), [cpuStride] "r"(cpuStride), [cpusCount] "r"(cpusCount), [pData] "r"(pData)
+                         : "memory", "cc");
+    return (void*)result;
+}
+
+// push element offset to the stack of the current CPU (returns false if the stack is full)
+SMM_INLINE bool RseqPush(RseqArea* rs, uint8_t* pStacks, uint64_t cpuStride, uint32_t cpusCount, uint32_t capacity,
+                         sm::internal::ElementOffset offset)
+{
+    uint64_t pStack;
+    uint64_t count;
+    uint32_t done;
+    __asm__ __volatile__(".pushsection __rseq_cs, \"aw\"\n\t"
+                         ".balign 32\n\t"
+                         "3:\n\t"
+                         ".long 0, 0\n\t"
+                         ".quad 1f, 2f - 1f, 4f\n\t"
+                         ".popsection\n\t"
+                         "0:\n\t"
+                         "leaq 3b(%%rip), %[pStack]\n\t"
+                         "movq %[pStack], 8(%[rs])\n\t"
+                         "1:\n\t"
+                         "xorl %[done], %[done]\n\t"
+                         "movl 4(%[rs]), %k[pStack]\n\t"
+                         "cmpl %[cpusCount], %k[pStack]\n\t"
+                         "jae 5f\n\t"
+                         "imulq %[cpuStride], %[pStack]\n\t"
+                         "addq %[pStacks], %[pStack]\n\t"
+                         "movl (%[pStack]), %k[count]\n\t"
+                         "cmpl %[capacity], %k[count]\n\t"
+                         "jae 5f\n\t"
+                         SMM_RSEQ_OFFSET_MOV " " SMM_RSEQ_OFFSET_REG("offset") ", " SMM_RSEQ_OFFSET_SIZE "(%[pStack], %[count], " SMM_RSEQ_OFFSET_SIZE
+                         ")\n\t"
+                         "addl $1, %k[count]\n\t"
+                         "movl %k[count], (%[pStack])\n\t"
+                         "2:\n\t"
+                         "movl $1, %[done]\n\t"
+                         "5:\n\t"
+                         ".pushsection __rseq_failure, \"ax\"\n\t"
+                         ".byte 0x0f, 0xb9, 0x3d\n\t"
+                         ".long 0x53053053\n\t"
+                         "4:\n\t"
+                         "jmp 0b\n\t"
+                         ".popsection\n\t"
+                         : [pStack] "=&r"(pStack), [count] "=&r"(count), [done] "=&r"(done)
+                         : [rs] "r"(rs), [pStacks] "r"(pStacks), [cpuStride] "r"(cpuStride), [cpusCount] "r"(cpusCount),
+                           [capacity] "r"(capacity), [offset] "r"(offset)
+                         : "memory", "cc");
+    return done != 0;
+}
+
+} // namespace
+
+namespace sm
+{
+namespace internal
+{
+
+struct CpuCache
+{
+    Allocator* alloc;
+    // stacks of all CPUs (cpusCount * cpuStride bytes)
+    uint8_t* pStacks;
+    size_t stacksBytesCount;
+    uint64_t cpuStride;
+    uint32_t cpusCount;
+    // stack offset (inside CPU region) and capacity per bucket
+    std::array<uint32_t, SMM_MAX_BUCKET_COUNT> stackOffset;
+    std::array<uint32_t, SMM_MAX_BUCKET_COUNT> stackCapacity;
+
+    static CpuCache* Create(Allocator* alloc)
+    {
+        long configuredCpusCount = sysconf(_SC_NPROCESSORS_CONF);
+        if (configuredCpusCount <= 0 || GetRseq() == nullptr)
+        {
+            return nullptr;
+        }
+
+        CpuCache* cache = (CpuCache*)GenericAllocator::Alloc(alloc->gAllocator, sizeof(CpuCache), alignof(CpuCache));
+        if (cache == nullptr)
+        {
+            return nullptr;
+        }
+
+        cache->alloc = alloc;
+        cache->cpusCount = uint32_t(configuredCpusCount);
+
+        // every stack starts at the cache line boundary, every CPU region starts at the page boundary
+        size_t offset = 0;
+        for (size_t i = 0; i < alloc->bucketsCount; i++)
+        {
+            cache->stackOffset[i] = uint32_t(offset);
+            cache->stackCapacity[i] = SMM_PER_CPU_CACHE_ITEMS_COUNT;
+            offset += Align(sizeof(ElementOffset) * (SMM_PER_CPU_CACHE_ITEMS_COUNT + 1), SMM_CACHE_LINE_SIZE);
+        }
+        cache->cpuStride = Align(offset, VirtualMemory::GetPageSize());
+
+        // pages of the CPUs that never run our threads are never touched
+        cache->stacksBytesCount = size_t(cache->cpuStride * cache->cpusCount);
+        cache->pStacks = (uint8_t*)VirtualMemory::Reserve(cache->stacksBytesCount);
+        if (cache->pStacks == nullptr || !VirtualMemory::Commit(cache->pStacks, cache->stacksBytesCount))
+        {
+            Destroy(cache);
+            return nullptr;
+        }
+
+        return cache;
+    }
+
+    static void Destroy(CpuCache* cache)
+    {
+        if (cache == nullptr)
+        {
+            return;
+        }
+
+        if (cache->pStacks)
+        {
+            VirtualMemory::Release(cache->pStacks, cache->stacksBytesCount);
+        }
+        GenericAllocator::Free(cache->alloc->gAllocator, cache);
+    }
+
+    SMM_INLINE uint8_t* GetStacks(size_t bucketIndex) const { return pStacks + stackOffset[bucketIndex]; }
+
+    SMM_INLINE void* Pop(RseqArea* rs, size_t bucketIndex) const
+    {
+        return RseqPop(rs, GetStacks(bucketIndex), cpuStride, cpusCount, alloc->buckets[bucketIndex].pData);
+    }
+
+    SMM_INLINE bool Push(RseqArea* rs, size_t bucketIndex, void* p) const
+    {
+        ElementOffset offset = ElementOffset((uint8_t*)p - alloc->buckets[bucketIndex].pData);
+        return RseqPush(rs, GetStacks(bucketIndex), cpuStride, cpusCount, stackCapacity[bucketIndex], offset);
+    }
+
+    // rseq area of a thread that is not registered (or a CPU that is not configured) has no valid CPU stack,
+    // such threads use the thread cache path instead of taking the slow paths on every call
+    SMM_INLINE bool HasCpuStack(const RseqArea* rs) const { return __atomic_load_n(&rs->cpuId, __ATOMIC_RELAXED) < cpusCount; }
+
+    // current CPU stack is empty, take a batch of elements from the centralized storage
+    SMM_NOINLINE void* Refill(RseqArea* rs, size_t bucketIndex)
+    {
+        Allocator::PoolBucket& bucket = alloc->buckets[bucketIndex];
+
+        // the whole batch is detached with a single CAS, pushes to the CPU stack don't need atomics
+        std::array<ElementOffset, SMM_PER_CPU_CACHE_ITEMS_COUNT / 2 + 1> offsets;
+        uint32_t batchSize = std::max(stackCapacity[bucketIndex] / 2, uint32_t(1));
+        SM_ASSERT(batchSize <= offsets.size());
+        uint32_t count = bucket.AllocChain(batchSize, offsets.data());
+        if (count == 0)
+        {
+            return nullptr;
+        }
+
+        uint32_t i = 1;
+        for (; i < count; i++)
+        {
+            // the stack could be filled by another thread running on the same CPU (or we have been migrated)
+            if (!Push(rs, bucketIndex, bucket.pData + offsets[i]))
+            {
+                break;
+            }
+        }
+
+        if (i < count)
+        {
+            // link the rest the same way as TlsPoolBucket::ReturnL1CacheToMaster does
+            ElementOffset localTag = 0xFFFFFF;
+            uint8_t* pHead = bucket.pData + offsets[i];
+            uint8_t* pTail = pHead;
+            for (i++; i < count; i++, localTag++)
+            {
+                Allocator::PoolBucket::TaggedIndex* pTag = (Allocator::PoolBucket::TaggedIndex*)pTail;
+                pTag->p.tag = localTag;
+                pTag->p.offset = offsets[i];
+                pTail = bucket.pData + offsets[i];
+            }
+            bucket.FreeInterval(pHead, pTail);
+        }
+        return bucket.pData + offsets[0];
+    }
+
+    // current CPU stack is full, return half of the elements to the centralized storage
+    SMM_NOINLINE bool Drain(RseqArea* rs, size_t bucketIndex, void* p)
+    {
+        Allocator::PoolBucket& bucket = alloc->buckets[bucketIndex];
+
+        ElementOffset localTag = 0xFFFFFF;
+        uint8_t* pHead = (uint8_t*)p;
+        uint8_t* pTail = pHead;
+        uint32_t count = stackCapacity[bucketIndex] / 2;
+        for (uint32_t i = 0; i < count; i++, localTag++)
+        {
+            uint8_t* pElement = (uint8_t*)Pop(rs, bucketIndex);
+            if (pElement == nullptr)
+            {
+                if (pTail == pHead)
+                {
+                    // no CPU stack (the thread lost its rseq registration), let the caller use the thread cache path
+                    return false;
+                }
+                break;
+            }
+
+            // link elements the same way as TlsPoolBucket::ReturnL1CacheToMaster does
+            Allocator::PoolBucket::TaggedIndex* pTag = (Allocator::PoolBucket::TaggedIndex*)pTail;
+            pTag->p.tag = localTag;
+            pTag->p.offset = ElementOffset(pElement - bucket.pData);
+            pTail = pElement;
+        }
+        bucket.FreeInterval(pHead, pTail);
+        return true;
+    }
+
+    SMM_INLINE void* Alloc(size_t bucketIndex)
+    {
+        RseqArea* rs = GetRseq();
+        if (SM_UNLIKELY(rs == nullptr || !HasCpuStack(rs)))
+        {
+            return nullptr;
+        }
+
+        void* pRes = Pop(rs, bucketIndex);
+        if (SM_LIKELY(pRes != nullptr))
+        {
+            return pRes;
+        }
+        return Refill(rs, bucketIndex);
+    }
+
+    SMM_INLINE size_t AllocBatch(size_t bucketIndex, size_t count, void** out)
+    {
+        RseqArea* rs = GetRseq();
+        if (SM_UNLIKELY(rs == nullptr || !HasCpuStack(rs)))
+        {
+            return 0;
+        }
+
+        // the caller takes the rest as whole chains from the bucket, refill would only move them through the stack
+        size_t doneCount = 0;
+        while (doneCount < count)
+        {
+            void* p = Pop(rs, bucketIndex);
+            if (p == nullptr)
+            {
+                break;
+            }
+            out[doneCount++] = p;
+        }
+        return doneCount;
+    }
+
+    SMM_INLINE bool Free(size_t bucketIndex, void* p)
+    {
+        RseqArea* rs = GetRseq();
+        if (SM_UNLIKELY(rs == nullptr || !HasCpuStack(rs)))
+        {
+            return false;
+        }
+
+        if (SM_LIKELY(Push(rs, bucketIndex, p)))
+        {
+            return true;
+        }
+        return Drain(rs, bucketIndex, p);
+    }
+};
+
+CpuCache* CreateCpuCache(Allocator* alloc) { return CpuCache::Create(alloc); }
+
+void DestroyCpuCache(CpuCache* cache) { CpuCache::Destroy(cache); }
+
+void* CpuCacheAlloc(CpuCache* cache, size_t bucketIndex) { return cache->Alloc(bucketIndex); }
+
+bool CpuCacheFree(CpuCache* cache, size_t bucketIndex, void* p) { return cache->Free(bucketIndex, p); }
+
+size_t CpuCacheAllocBatch(CpuCache* cache, size_t bucketIndex, size_t count, void** out)
+{
+    return cache->AllocBatch(bucketIndex, count, out);
+}
+
+} // namespace internal
+} // namespace sm
+
+#else
+
+namespace sm
+{
+namespace internal
+{
+
+CpuCache* CreateCpuCache(Allocator* /*alloc*/) { return nullptr; }
+
+void DestroyCpuCache(CpuCache* /*cache*/) {}
+
+} // namespace internal
+} // namespace sm
+
+#endif
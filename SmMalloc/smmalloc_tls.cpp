@@ -21,12 +21,152 @@
 // 	THE SOFTWARE.
 #include "smmalloc.h"
 
-thread_local sm::internal::TlsPoolBucket tlsCacheBuckets[SMM_MAX_BUCKET_COUNT];
-// sm::internal::TlsPoolBucket tlsCacheBuckets[SMM_MAX_BUCKET_COUNT];
+namespace sm
+{
+namespace internal
+{
+// thread caches table indexed by allocator cache id (the last slot is used by allocators without thread caches and is always empty)
+SMM_TLS_VARIABLE TlsCacheSlot tlsCaches[SMM_MAX_THREAD_CACHES_COUNT + 1];
+
+// shared by all threads without a cache (never written, zero capacity buckets are only read)
+TlsPoolBucket emptyCacheBuckets[SMM_MAX_BUCKET_COUNT];
+} // namespace internal
+} // namespace sm
+
+thread_local uint32_t tlsShardIndex = 0;
+
+static std::atomic<uint64_t> usedCacheIds(0);
+
+namespace
+{
+// generation of every cache id (changed when the allocator releases the id), the lock keeps the allocator alive while an exiting
+// thread destroys its cache
+struct CacheIdState
+{
+    sm::internal::SpinLock lock;
+    std::atomic<uint32_t> generation;
+};
+
+CacheIdState cacheIdStates[SMM_MAX_THREAD_CACHES_COUNT];
+
+// flushes thread caches on thread exit (registered when the first cache of the thread is created)
+struct ThreadCacheGuard
+{
+    bool isActive;
+
+    ~ThreadCacheGuard()
+    {
+        for (uint32_t cacheId = 0; cacheId < SMM_MAX_THREAD_CACHES_COUNT; cacheId++)
+        {
+            sm::internal::TlsCacheSlot& slot = sm::internal::tlsCaches[cacheId];
+            if (slot.cache == nullptr)
+            {
+                continue;
+            }
+
+            // allocator could be destroyed before the thread (then it already released the cache)
+            CacheIdState& state = cacheIdStates[cacheId];
+            sm::internal::SpinLockGuard lock(state.lock);
+            if (state.generation.load(std::memory_order_relaxed) == slot.generation)
+            {
+                slot.cache->owner->DestroyThreadCache();
+            }
+            slot.cache = nullptr;
+        }
+    }
+};
+} // namespace
+
+thread_local ThreadCacheGuard tlsCacheGuard;
 
 namespace sm
 {
 
-sm::internal::TlsPoolBucket* GetTlsBucket(size_t index) { return &tlsCacheBuckets[index]; }
+#ifdef SMM_OUT_OF_LINE_TLS
+sm::internal::TlsPoolBucket* GetTlsBucket(uint32_t cacheId, uint32_t cacheGeneration, size_t index)
+{
+    if (SM_UNLIKELY(index >= SMM_MAX_BUCKET_COUNT))
+    {
+        // unreachable (index < bucketsCount), keeps the bound visible to compilers (bucketsCount is only known at run time)
+        return &internal::emptyCacheBuckets[0];
+    }
+
+    const internal::TlsCacheSlot& slot = internal::tlsCaches[cacheId];
+    return (slot.cache && slot.generation == cacheGeneration) ? &slot.cache->buckets[index] : &internal::emptyCacheBuckets[index];
+}
+#endif
+
+uint32_t GetTlsShardIndex()
+{
+    // threads are spread over the shards in round robin order
+    static std::atomic<uint32_t> threadsCounter(0);
+    uint32_t index = tlsShardIndex;
+    if (SM_UNLIKELY(index == 0))
+    {
+        index = threadsCounter.fetch_add(1, std::memory_order_relaxed) + 1;
+        tlsShardIndex = index;
+    }
+    return index;
+}
+
+namespace internal
+{
+
+uint32_t AcquireThreadCacheId(uint32_t& cacheGeneration)
+{
+    uint64_t used = usedCacheIds.load(std::memory_order_relaxed);
+    while (true)
+    {
+        uint32_t cacheId = 0;
+        while (cacheId < SMM_MAX_THREAD_CACHES_COUNT && (used & (uint64_t(1) << cacheId)) != 0)
+        {
+            cacheId++;
+        }
+
+        if (cacheId == SMM_MAX_THREAD_CACHES_COUNT)
+        {
+            return SMM_MAX_THREAD_CACHES_COUNT;
+        }
+
+        if (usedCacheIds.compare_exchange_weak(used, used | (uint64_t(1) << cacheId), std::memory_order_acquire))
+        {
+            cacheGeneration = cacheIdStates[cacheId].generation.load(std::memory_order_relaxed);
+            return cacheId;
+        }
+    }
+}
+
+void ReleaseThreadCacheId(uint32_t cacheId)
+{
+    if (cacheId < SMM_MAX_THREAD_CACHES_COUNT)
+    {
+        // wait for the threads that are destroying their caches right now, the rest never touch the caches of this generation
+        CacheIdState& state = cacheIdStates[cacheId];
+        {
+            internal::SpinLockGuard lock(state.lock);
+            state.generation.fetch_add(1, std::memory_order_relaxed);
+        }
+        usedCacheIds.fetch_and(~(uint64_t(1) << cacheId), std::memory_order_release);
+    }
+}
+
+ThreadCache* GetThreadCache(uint32_t cacheId, uint32_t cacheGeneration)
+{
+    const TlsCacheSlot& slot = tlsCaches[cacheId];
+    return (slot.generation == cacheGeneration) ? slot.cache : nullptr;
+}
+
+void SetThreadCache(uint32_t cacheId, uint32_t cacheGeneration, ThreadCache* cache)
+{
+    SM_ASSERT(cacheId < SMM_MAX_THREAD_CACHES_COUNT);
+    tlsCaches[cacheId].cache = cache;
+    tlsCaches[cacheId].generation = cacheGeneration;
+    if (cache)
+    {
+        tlsCacheGuard.isActive = true;
+    }
+}
+
+} // namespace internal
 
 } // namespace sm
@@ -0,0 +1,183 @@
+// The MIT License (MIT)
+//
+// 	Copyright (c) 2017-2023 Sergey Makeev
+//
+// 	Permission is hereby granted, free of charge, to any person obtaining a copy
+// 	of this software and associated documentation files (the "Software"), to deal
+// 	in the Software without restriction, including without limitation the rights
+// 	to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// 	copies of the Software, and to permit persons to whom the Software is
+// 	furnished to do so, subject to the following conditions:
+//
+//      The above copyright notice and this permission notice shall be included in
+// 	all copies or substantial portions of the Software.
+//
+// 	THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// 	IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// 	FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// 	AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// 	LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// 	OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// 	THE SOFTWARE.
+#include "smmalloc.h"
+
+#if defined(_WIN32)
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+size_t sm::VirtualMemory::GetPageSize()
+{
+#if defined(_WIN32)
+    static const size_t pageSize = []() {
+        SYSTEM_INFO info;
+        GetSystemInfo(&info);
+        return size_t(info.dwPageSize);
+    }();
+#else
+    static const size_t pageSize = size_t(sysconf(_SC_PAGESIZE));
+#endif
+    return pageSize;
+}
+
+size_t sm::VirtualMemory::GetHugePageSize()
+{
+#if defined(_WIN32)
+    static const size_t hugePageSize = []() {
+        size_t largePageSize = size_t(GetLargePageMinimum());
+        return (largePageSize != 0) ? largePageSize : size_t(2 * 1024 * 1024);
+    }();
+    return hugePageSize;
+#else
+    return size_t(2 * 1024 * 1024);
+#endif
+}
+
+void* sm::VirtualMemory::Reserve(size_t bytesCount)
+{
+#if defined(_WIN32)
+    return VirtualAlloc(nullptr, bytesCount, MEM_RESERVE, PAGE_NOACCESS);
+#else
+    int flags = MAP_PRIVATE | MAP_ANONYMOUS;
+#ifdef MAP_NORESERVE
+    flags |= MAP_NORESERVE;
+#endif
+    void* p = mmap(nullptr, bytesCount, PROT_NONE, flags, -1, 0);
+    return (p == MAP_FAILED) ? nullptr : p;
+#endif
+}
+
+void* sm::VirtualMemory::ReserveAligned(size_t bytesCount, size_t alignment)
+{
+    if (alignment <= GetPageSize())
+    {
+        return Reserve(bytesCount);
+    }
+
+#if defined(_WIN32)
+    // reserve bigger range to find aligned address, then try to reserve exactly at that address
+    // (another thread can take the range in between, so try several times)
+    for (int attempt = 0; attempt < 8; attempt++)
+    {
+        void* p = Reserve(bytesCount + alignment);
+        if (p == nullptr)
+        {
+            return nullptr;
+        }
+        void* aligned = (void*)Align(size_t(p), alignment);
+        VirtualFree(p, 0, MEM_RELEASE);
+
+        p = VirtualAlloc(aligned, bytesCount, MEM_RESERVE, PAGE_NOACCESS);
+        if (p)
+        {
+            return p;
+        }
+    }
+    return nullptr;
+#else
+    // reserve bigger range and unmap unaligned head and tail
+    size_t paddedBytesCount = bytesCount + alignment;
+    uint8_t* p = (uint8_t*)Reserve(paddedBytesCount);
+    if (p == nullptr)
+    {
+        return nullptr;
+    }
+
+    uint8_t* aligned = (uint8_t*)Align(size_t(p), alignment);
+    if (aligned > p)
+    {
+        munmap(p, size_t(aligned - p));
+    }
+
+    size_t tailBytesCount = size_t((p + paddedBytesCount) - (aligned + bytesCount));
+    if (tailBytesCount > 0)
+    {
+        munmap(aligned + bytesCount, tailBytesCount);
+    }
+    return aligned;
+#endif
+}
+
+void* sm::VirtualMemory::AllocateHugePages(size_t bytesCount)
+{
+    SM_ASSERT(IsAligned(bytesCount, GetHugePageSize()));
+#if defined(_WIN32)
+    // requires SeLockMemoryPrivilege, fails otherwise
+    return VirtualAlloc(nullptr, bytesCount, MEM_RESERVE | MEM_COMMIT | MEM_LARGE_PAGES, PAGE_READWRITE);
+#elif defined(MAP_HUGETLB)
+    // no MAP_NORESERVE, huge pages are reserved at mapping time and mmap fails if the pool is too small
+    void* p = mmap(nullptr, bytesCount, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    return (p == MAP_FAILED) ? nullptr : p;
+#else
+    SMMALLOC_UNUSED(bytesCount);
+    return nullptr;
+#endif
+}
+
+bool sm::VirtualMemory::AdviseHugePages(void* p, size_t bytesCount)
+{
+#if defined(MADV_HUGEPAGE)
+    return madvise(p, bytesCount, MADV_HUGEPAGE) == 0;
+#else
+    SMMALLOC_UNUSED(p);
+    SMMALLOC_UNUSED(bytesCount);
+    return false;
+#endif
+}
+
+bool sm::VirtualMemory::Commit(void* p, size_t bytesCount)
+{
+    SM_ASSERT(IsAligned(size_t(p), GetPageSize()) && IsAligned(bytesCount, GetPageSize()));
+#if defined(_WIN32)
+    return VirtualAlloc(p, bytesCount, MEM_COMMIT, PAGE_READWRITE) != nullptr;
+#else
+    return mprotect(p, bytesCount, PROT_READ | PROT_WRITE) == 0;
+#endif
+}
+
+bool sm::VirtualMemory::Purge(void* p, size_t bytesCount)
+{
+    SM_ASSERT(IsAligned(size_t(p), GetPageSize()) && IsAligned(bytesCount, GetPageSize()));
+#if defined(_WIN32)
+    // pages stay committed (and accessible), but the system can discard their content
+    return VirtualAlloc(p, bytesCount, MEM_RESET, PAGE_READWRITE) != nullptr;
+#elif defined(__APPLE__)
+    return madvise(p, bytesCount, MADV_FREE) == 0;
+#else
+    return madvise(p, bytesCount, MADV_DONTNEED) == 0;
+#endif
+}
+
+void sm::VirtualMemory::Release(void* p, size_t bytesCount)
+{
+#if defined(_WIN32)
+    SMMALLOC_UNUSED(bytesCount);
+    VirtualFree(p, 0, MEM_RELEASE);
+#else
+    munmap(p, bytesCount);
+#endif
+}
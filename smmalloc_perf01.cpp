@@ -119,6 +119,71 @@ void printDebug(sm_allocator) {}
 #undef MALLOC
 #undef FREE
 
+// ============ smmalloc with thread cache enabled (huge pages) ============
+#define ALLOCATOR_TEST_NAME sm_hp
+#define HEAP sm_allocator
+#define CREATE_HEAP _sm_allocator_create(10, (64 * 1024 * 1024), sm::ALLOCATOR_HUGE_PAGES)
+#define DESTROY_HEAP                                                                                                                       \
+    printDebug(heap);                                                                                                                      \
+    _sm_allocator_destroy(heap)
+#define ON_THREAD_START                                                                                                                    \
+    _sm_allocator_thread_cache_create(heap, sm::CACHE_WARM, {16384, 131072, 131072, 131072, 131072, 131072, 131072, 131072, 131072, 131072})
+#define ON_THREAD_FINISHED _sm_allocator_thread_cache_destroy(heap)
+#define MALLOC(size, align) _sm_malloc(heap, size, align)
+#define FREE(p) _sm_free(heap, p)
+#include "smmalloc_test_impl.inl"
+#undef ALLOCATOR_TEST_NAME
+#undef HEAP
+#undef CREATE_HEAP
+#undef DESTROY_HEAP
+#undef ON_THREAD_START
+#undef ON_THREAD_FINISHED
+#undef MALLOC
+#undef FREE
+
+// ============ smmalloc with per CPU cache enabled (thread cache disabled) ============
+#define ALLOCATOR_TEST_NAME sm_cpu
+#define HEAP sm_allocator
+#define CREATE_HEAP _sm_allocator_create(10, (64 * 1024 * 1024), sm::ALLOCATOR_PER_CPU_CACHE)
+#define DESTROY_HEAP                                                                                                                       \
+    printDebug(heap);                                                                                                                      \
+    _sm_allocator_destroy(heap)
+#define ON_THREAD_START
+#define ON_THREAD_FINISHED
+#define MALLOC(size, align) _sm_malloc(heap, size, align)
+#define FREE(p) _sm_free(heap, p)
+#include "smmalloc_test_impl.inl"
+#undef ALLOCATOR_TEST_NAME
+#undef HEAP
+#undef CREATE_HEAP
+#undef DESTROY_HEAP
+#undef ON_THREAD_START
+#undef ON_THREAD_FINISHED
+#undef MALLOC
+#undef FREE
+
+// ============ smmalloc with adaptive thread cache (capacities below are upper limits) ============
+#define ALLOCATOR_TEST_NAME sm_ad
+#define HEAP sm_allocator
+#define CREATE_HEAP _sm_allocator_create(10, (64 * 1024 * 1024), sm::ALLOCATOR_ADAPTIVE_THREAD_CACHE)
+#define DESTROY_HEAP                                                                                                                       \
+    printDebug(heap);                                                                                                                      \
+    _sm_allocator_destroy(heap)
+#define ON_THREAD_START                                                                                                                    \
+    _sm_allocator_thread_cache_create(heap, sm::CACHE_WARM, {16384, 131072, 131072, 131072, 131072, 131072, 131072, 131072, 131072, 131072})
+#define ON_THREAD_FINISHED _sm_allocator_thread_cache_destroy(heap)
+#define MALLOC(size, align) _sm_malloc(heap, size, align)
+#define FREE(p) _sm_free(heap, p)
+#include "smmalloc_test_impl.inl"
+#undef ALLOCATOR_TEST_NAME
+#undef HEAP
+#undef CREATE_HEAP
+#undef DESTROY_HEAP
+#undef ON_THREAD_START
+#undef ON_THREAD_FINISHED
+#undef MALLOC
+#undef FREE
+
 // ============ smmalloc with thread cache disabled ============
 #define ALLOCATOR_TEST_NAME sm_tcd
 #define HEAP sm_allocator
@@ -319,6 +384,9 @@ void compare_allocators()
     printf("name\tnum_threads\tops_min\tops_max\tops_avg\ttime_min\ttime_max\n");
     DoTest_crt();
     DoTest_sm();
+    DoTest_sm_hp();
+    DoTest_sm_cpu();
+    DoTest_sm_ad();
    
 #if defined(_WIN32)
     DoTest_mi();
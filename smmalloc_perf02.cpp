@@ -1,3 +1,6 @@
+#include <algorithm>
+#include <array>
+#include <chrono>
 #include <cstddef>
 #include <dlmalloc.h>
 #include <rpmalloc.h>
@@ -10,6 +13,12 @@
 #include <mimalloc.h>
 #endif
 
+#if defined(__linux__)
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
 struct UBenchGlobals
 {
     static const int kNumAllocations = 10000000;
@@ -116,6 +125,369 @@ UBENCH_EX(PerfTest, smmalloc_10m)
     _sm_allocator_destroy(space);
 }
 
+// the same as smmalloc_10m, but blocks are freed with the known size (no pointer to bucket lookup)
+UBENCH_EX(PerfTest, smmalloc_10m_sized_free)
+{
+    UBenchGlobals& g = UBenchGlobals::get();
+    size_t wsSize = g.workingSet.size();
+    std::vector<size_t> workingSetSizes(wsSize, 0);
+
+    sm_allocator space = _sm_allocator_create(18, (48 * 1024 * 1024));
+    _sm_allocator_thread_cache_create(space, sm::CACHE_COLD,
+                                      {512, 512, 512, 512, 512, 512, 512, 512, 512, 512, 512, 512, 512, 512, 512, 512, 512, 512});
+
+    UBENCH_DO_BENCHMARK()
+    {
+        size_t freeIndex = 0;
+        size_t allocIndex = wsSize - 1;
+
+        for (size_t i = 0; i < g.randomSequence.size(); i++)
+        {
+            size_t numBytesToAllocate = g.randomSequence[i];
+            void* ptr = _sm_malloc(space, numBytesToAllocate, 1);
+            memset(ptr, 33, numBytesToAllocate);
+
+            g.workingSet[allocIndex % wsSize] = ptr;
+            workingSetSizes[allocIndex % wsSize] = numBytesToAllocate;
+            void* ptrToFree = g.workingSet[freeIndex % wsSize];
+            _sm_free_sized(space, ptrToFree, workingSetSizes[freeIndex % wsSize], 1);
+            g.workingSet[freeIndex % wsSize] = nullptr;
+            workingSetSizes[freeIndex % wsSize] = 0;
+
+            allocIndex++;
+            freeIndex++;
+        }
+
+        for (size_t i = 0; i < wsSize; i++)
+        {
+            _sm_free_sized(space, g.workingSet[i], workingSetSizes[i], 1);
+            g.workingSet[i] = nullptr;
+            workingSetSizes[i] = 0;
+        }
+    }
+
+    _sm_allocator_thread_cache_destroy(space);
+    _sm_allocator_destroy(space);
+}
+
+// several allocators (one per subsystem) used from the same thread, every allocator has its own thread cache
+UBENCH_EX(PerfTest, smmalloc_4_allocators_10m)
+{
+    UBenchGlobals& g = UBenchGlobals::get();
+    size_t wsSize = g.workingSet.size();
+
+    std::array<sm_allocator, 4> spaces;
+    for (sm_allocator& space : spaces)
+    {
+        space = _sm_allocator_create(18, (16 * 1024 * 1024));
+        _sm_allocator_thread_cache_create(space, sm::CACHE_COLD,
+                                          {512, 512, 512, 512, 512, 512, 512, 512, 512, 512, 512, 512, 512, 512, 512, 512, 512, 512});
+    }
+
+    UBENCH_DO_BENCHMARK()
+    {
+        size_t freeIndex = 0;
+        size_t allocIndex = wsSize - 1;
+
+        for (size_t i = 0; i < g.randomSequence.size(); i++)
+        {
+            // element allocated at the step N is freed at the step N (working set size is a multiple of allocators count)
+            size_t numBytesToAllocate = g.randomSequence[i];
+            void* ptr = _sm_malloc(spaces[allocIndex % spaces.size()], numBytesToAllocate, 1);
+            memset(ptr, 33, numBytesToAllocate);
+
+            g.workingSet[allocIndex % wsSize] = ptr;
+            void* ptrToFree = g.workingSet[freeIndex % wsSize];
+            _sm_free(spaces[freeIndex % spaces.size()], ptrToFree);
+            g.workingSet[freeIndex % wsSize] = nullptr;
+
+            allocIndex++;
+            freeIndex++;
+        }
+
+        for (size_t i = 0; i < wsSize; i++)
+        {
+            _sm_free(spaces[i % spaces.size()], g.workingSet[i]);
+            g.workingSet[i] = nullptr;
+        }
+    }
+
+    for (sm_allocator space : spaces)
+    {
+        _sm_allocator_thread_cache_destroy(space);
+        _sm_allocator_destroy(space);
+    }
+}
+
+// allocator creation time (large arena, eager free list vs lazy frontier)
+UBENCH_EX(StartupTest, smmalloc_create_eager)
+{
+    UBENCH_DO_BENCHMARK()
+    {
+        sm_allocator space = _sm_allocator_create(SMM_MAX_BUCKET_COUNT, (8 * 1024 * 1024), sm::ALLOCATOR_EAGER_INIT);
+        _sm_allocator_destroy(space);
+    }
+}
+
+UBENCH_EX(StartupTest, smmalloc_create_lazy)
+{
+    UBENCH_DO_BENCHMARK()
+    {
+        sm_allocator space = _sm_allocator_create(SMM_MAX_BUCKET_COUNT, (8 * 1024 * 1024));
+        _sm_allocator_destroy(space);
+    }
+}
+
+// geometrically growing buffer (64Kb -> 256Mb) routed to the fallback allocator
+UBENCH_EX(ReallocTest, smmalloc_grow_256mb)
+{
+    sm_allocator space = _sm_allocator_create(18, (1024 * 1024));
+
+    UBENCH_DO_BENCHMARK()
+    {
+        size_t bytesCount = 64 * 1024;
+        void* p = _sm_malloc(space, bytesCount, 16);
+        memset(p, 33, bytesCount);
+        while (bytesCount < 256 * 1024 * 1024)
+        {
+            p = _sm_realloc(space, p, bytesCount * 2, 16);
+            memset((char*)p + bytesCount, 33, bytesCount);
+            bytesCount *= 2;
+        }
+        _sm_free(space, p);
+    }
+
+    _sm_allocator_destroy(space);
+}
+
+UBENCH_EX(ReallocTest, crt_grow_256mb)
+{
+    UBENCH_DO_BENCHMARK()
+    {
+        size_t bytesCount = 64 * 1024;
+        void* p = malloc(bytesCount);
+        memset(p, 33, bytesCount);
+        while (bytesCount < 256 * 1024 * 1024)
+        {
+            p = realloc(p, bytesCount * 2);
+            memset((char*)p + bytesCount, 33, bytesCount);
+            bytesCount *= 2;
+        }
+        free(p);
+    }
+}
+
+// same sized blocks allocated in groups (the groups don't fit into the thread cache)
+static const size_t kBatchSize = 256;
+static const size_t kBatchesCount = 20000;
+
+UBENCH_EX(BatchTest, smmalloc_malloc_loop)
+{
+    sm_allocator space = _sm_allocator_create(8, (16 * 1024 * 1024));
+    _sm_allocator_thread_cache_create(space, sm::CACHE_COLD, {128, 128, 128, 128, 128, 128, 128, 128});
+
+    std::array<void*, kBatchSize> ptrs;
+    UBENCH_DO_BENCHMARK()
+    {
+        for (size_t i = 0; i < kBatchesCount; i++)
+        {
+            for (void*& p : ptrs)
+            {
+                p = _sm_malloc(space, 48, 16);
+            }
+            for (void* p : ptrs)
+            {
+                _sm_free(space, p);
+            }
+        }
+    }
+
+    _sm_allocator_thread_cache_destroy(space);
+    _sm_allocator_destroy(space);
+}
+
+UBENCH_EX(BatchTest, smmalloc_malloc_batch)
+{
+    sm_allocator space = _sm_allocator_create(8, (16 * 1024 * 1024));
+    _sm_allocator_thread_cache_create(space, sm::CACHE_COLD, {128, 128, 128, 128, 128, 128, 128, 128});
+
+    std::array<void*, kBatchSize> ptrs;
+    UBENCH_DO_BENCHMARK()
+    {
+        for (size_t i = 0; i < kBatchesCount; i++)
+        {
+            _sm_malloc_batch(space, 48, 16, ptrs.size(), ptrs.data());
+            for (void* p : ptrs)
+            {
+                _sm_free(space, p);
+            }
+        }
+    }
+
+    _sm_allocator_thread_cache_destroy(space);
+    _sm_allocator_destroy(space);
+}
+
+UBENCH_EX(BatchTest, smmalloc_malloc_batch_free_batch)
+{
+    sm_allocator space = _sm_allocator_create(8, (16 * 1024 * 1024));
+    _sm_allocator_thread_cache_create(space, sm::CACHE_COLD, {128, 128, 128, 128, 128, 128, 128, 128});
+
+    std::array<void*, kBatchSize> ptrs;
+    UBENCH_DO_BENCHMARK()
+    {
+        for (size_t i = 0; i < kBatchesCount; i++)
+        {
+            _sm_malloc_batch(space, 48, 16, ptrs.size(), ptrs.data());
+            _sm_free_batch(space, ptrs.data(), ptrs.size());
+        }
+    }
+
+    _sm_allocator_thread_cache_destroy(space);
+    _sm_allocator_destroy(space);
+}
+
+// retired user mode instructions of the calling thread (Linux only)
+struct InstructionsCounter
+{
+    int fd;
+
+    InstructionsCounter()
+        : fd(-1)
+    {
+#if defined(__linux__)
+        perf_event_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        attr.type = PERF_TYPE_HARDWARE;
+        attr.size = sizeof(attr);
+        attr.config = PERF_COUNT_HW_INSTRUCTIONS;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        fd = int(syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0));
+#endif
+    }
+
+    ~InstructionsCounter()
+    {
+#if defined(__linux__)
+        if (fd >= 0)
+        {
+            close(fd);
+        }
+#endif
+    }
+
+    bool IsValid() const { return fd >= 0; }
+
+    uint64_t Read() const
+    {
+        uint64_t value = 0;
+#if defined(__linux__)
+        if (fd >= 0 && read(fd, &value, sizeof(value)) != sizeof(value))
+        {
+            value = 0;
+        }
+#endif
+        return value;
+    }
+};
+
+// cost of the thread cache fast path (compare builds with and without SMMALLOC_OUT_OF_LINE_TLS)
+UBENCH_EX(PerfTest, smmalloc_hot_cache_ops)
+{
+    const size_t kOpsCount = 10000000;
+    sm_allocator space = _sm_allocator_create(4, (1024 * 1024));
+    _sm_allocator_thread_cache_create(space, sm::CACHE_HOT, {64, 64, 64, 64});
+
+    InstructionsCounter counter;
+    uint64_t instructionsCount = 0;
+    size_t opsCount = 0;
+    UBENCH_DO_BENCHMARK()
+    {
+        uint64_t startCount = counter.Read();
+        for (size_t i = 0; i < kOpsCount; i++)
+        {
+            void* p = _sm_malloc(space, 16 + (i & 31), 16);
+            *(uint8_t*)p = 33;
+            _sm_free(space, p);
+        }
+        instructionsCount += counter.Read() - startCount;
+        opsCount += kOpsCount * 2;
+    }
+
+#ifdef SMM_OUT_OF_LINE_TLS
+    const char* tlsMode = "out of line";
+#else
+    const char* tlsMode = "inline";
+#endif
+    if (counter.IsValid() && opsCount != 0)
+    {
+        printf("TLS lookup: %s, instructions per operation: %.1f\n", tlsMode, double(instructionsCount) / double(opsCount));
+    }
+    else
+    {
+        printf("TLS lookup: %s, instructions counter is not available\n", tlsMode);
+    }
+
+    _sm_allocator_thread_cache_destroy(space);
+    _sm_allocator_destroy(space);
+}
+
+// per call free latency with a huge thread cache (the working set overflows the cache over and over)
+static void MeasureFreeLatency(sm_allocator space, std::vector<void*>& ptrs, std::vector<double>& latencies)
+{
+    for (void*& p : ptrs)
+    {
+        p = _sm_malloc(space, 16, 16);
+        memset(p, 33, 16);
+    }
+
+    for (void* p : ptrs)
+    {
+        auto start = std::chrono::high_resolution_clock::now();
+        _sm_free(space, p);
+        auto finish = std::chrono::high_resolution_clock::now();
+        latencies.push_back(std::chrono::duration<double, std::nano>(finish - start).count());
+    }
+}
+
+static void PrintFreeLatency(std::vector<double>& latencies)
+{
+    std::sort(latencies.begin(), latencies.end());
+    size_t count = latencies.size();
+    size_t spikesCount = size_t(latencies.end() - std::upper_bound(latencies.begin(), latencies.end(), 100000.0));
+    printf("free latency (ns): p50 %.0f, p99 %.0f, p99.9 %.0f, p99.99 %.0f, max %.0f, calls above 100us: %zu\n", latencies[count / 2],
+           latencies[count * 99 / 100], latencies[count * 999 / 1000], latencies[count * 9999 / 10000], latencies[count - 1], spikesCount);
+}
+
+static void FreeLatencyTest(uint32_t flags)
+{
+    sm_allocator space = _sm_allocator_create(2, (32 * 1024 * 1024), flags);
+    _sm_allocator_thread_cache_create(space, sm::CACHE_COLD, {131072, 16});
+
+    std::vector<void*> ptrs(512 * 1024);
+    std::vector<double> latencies;
+    latencies.reserve(ptrs.size() * 8);
+    for (int pass = 0; pass < 8; pass++)
+    {
+        MeasureFreeLatency(space, ptrs, latencies);
+    }
+    PrintFreeLatency(latencies);
+
+    _sm_allocator_thread_cache_destroy(space);
+    _sm_allocator_destroy(space);
+}
+
+UBENCH_EX(LatencyTest, smmalloc_free_half_flush)
+{
+    UBENCH_DO_BENCHMARK() { FreeLatencyTest(sm::ALLOCATOR_DEFAULT); }
+}
+
+UBENCH_EX(LatencyTest, smmalloc_free_incremental_flush)
+{
+    UBENCH_DO_BENCHMARK() { FreeLatencyTest(sm::ALLOCATOR_INCREMENTAL_FLUSH); }
+}
+
 // crt ubench test
 UBENCH_EX(PerfTest, crt_10m)
 {
@@ -1,3 +1,4 @@
+#include <algorithm>
 #include <array>
 #include <gtest/gtest.h>
 #include <inttypes.h>
@@ -347,3 +348,954 @@ TEST(SimpleTests, ReAlloc)
 
     _sm_allocator_destroy(heap);
 }
+
+TEST(SimpleTests, VirtualArena)
+{
+    // reserve 62 buckets, 64Mb each (only touched pages are committed)
+    sm_allocator heap = _sm_allocator_create(SMM_MAX_BUCKET_COUNT, (64 * 1024 * 1024), sm::ALLOCATOR_VIRTUAL_ARENA);
+    for (int32_t bucketIndex = 0; bucketIndex < SMM_MAX_BUCKET_COUNT; bucketIndex++)
+    {
+        size_t elementSize = sm::GetBucketSizeInBytesByIndex(bucketIndex);
+        void* p = _sm_malloc(heap, elementSize, 16);
+        ASSERT_EQ(_sm_mbucket(heap, p), bucketIndex);
+        std::memset(p, 0xCD, elementSize);
+        _sm_free(heap, p);
+    }
+    _sm_allocator_destroy(heap);
+}
+
+TEST(SimpleTests, ArenaModes)
+{
+    std::array<uint32_t, 4> modes = {sm::ALLOCATOR_DEFAULT, sm::ALLOCATOR_EAGER_INIT, sm::ALLOCATOR_VIRTUAL_ARENA,
+                                     sm::ALLOCATOR_VIRTUAL_ARENA | sm::ALLOCATOR_EAGER_INIT};
+
+    for (uint32_t flags : modes)
+    {
+        // exhaust every bucket to make sure every element is reachable
+        sm_allocator heap = _sm_allocator_create(4, (1024 * 1024 + 4096), flags);
+        for (int32_t bucketIndex = 0; bucketIndex < 4; bucketIndex++)
+        {
+            size_t elementSize = sm::GetBucketSizeInBytesByIndex(bucketIndex);
+            size_t maxCount = heap->GetBucketElementsCount(bucketIndex);
+
+            std::vector<void*> ptrs;
+            for (;;)
+            {
+                void* p = _sm_malloc(heap, elementSize, 1);
+                ptrs.push_back(p);
+                if (_sm_mbucket(heap, p) != bucketIndex)
+                {
+                    break;
+                }
+                std::memset(p, 0xCD, elementSize);
+            }
+            EXPECT_EQ(ptrs.size() - 1, maxCount);
+
+            for (size_t i = 0; i < ptrs.size(); i++)
+            {
+                _sm_free(heap, ptrs[i]);
+            }
+        }
+        _sm_allocator_destroy(heap);
+    }
+}
+
+TEST(SimpleTests, GrowableBuckets)
+{
+    // small buckets that have to grow several times before falling back to the generic allocator
+    const size_t bucketSize = 64 * 1024;
+    sm_allocator heap = _sm_allocator_create(4, bucketSize, sm::ALLOCATOR_GROWABLE_BUCKETS);
+
+    size_t elementSize = sm::GetBucketSizeInBytesByIndex(0);
+    size_t initialCount = heap->GetBucketElementsCount(0);
+    EXPECT_GT(initialCount, (size_t)0);
+
+    std::vector<void*> ptrs;
+    for (;;)
+    {
+        void* p = _sm_malloc(heap, elementSize, 1);
+        ptrs.push_back(p);
+        if (_sm_mbucket(heap, p) != 0)
+        {
+            break;
+        }
+        std::memset(p, 0xCD, elementSize);
+    }
+
+    size_t grownCount = heap->GetBucketElementsCount(0);
+    EXPECT_EQ(ptrs.size() - 1, grownCount);
+    EXPECT_GE(grownCount, initialCount * SMM_MAX_BUCKET_SEGMENTS_COUNT);
+
+    // neighbour buckets are not affected
+    EXPECT_EQ(bucketSize / sm::GetBucketSizeInBytesByIndex(1), heap->GetBucketElementsCount(1));
+    void* p = _sm_malloc(heap, sm::GetBucketSizeInBytesByIndex(1), 1);
+    EXPECT_EQ(_sm_mbucket(heap, p), 1);
+    _sm_free(heap, p);
+
+    for (size_t i = 0; i < ptrs.size(); i++)
+    {
+        _sm_free(heap, ptrs[i]);
+    }
+    _sm_allocator_destroy(heap);
+}
+
+TEST(SimpleTests, Trim)
+{
+    sm_allocator heap = _sm_allocator_create(4, (4 * 1024 * 1024), sm::ALLOCATOR_VIRTUAL_ARENA);
+
+    // nothing to trim yet
+    EXPECT_EQ(_sm_allocator_trim(heap), (size_t)0);
+
+    size_t elementSize = sm::GetBucketSizeInBytesByIndex(0);
+    size_t count = heap->GetBucketElementsCount(0);
+    std::vector<void*> ptrs(count);
+    for (size_t i = 0; i < count; i++)
+    {
+        ptrs[i] = _sm_malloc(heap, elementSize, 1);
+        ASSERT_EQ(_sm_mbucket(heap, ptrs[i]), 0);
+        std::memset(ptrs[i], 0xCD, elementSize);
+    }
+
+    // free the first half of the bucket and every other element of the second half
+    for (size_t i = 0; i < count; i++)
+    {
+        if (i < count / 2 || (i & 1) == 0)
+        {
+            _sm_free(heap, ptrs[i]);
+            ptrs[i] = nullptr;
+        }
+    }
+
+    size_t releasedBytes = _sm_allocator_trim(heap);
+    EXPECT_GE(releasedBytes, (count / 2 - 1) * elementSize - 2 * 4096);
+    EXPECT_LE(releasedBytes, (count / 2) * elementSize);
+
+    // pages in use must not be touched
+    for (size_t i = 0; i < count; i++)
+    {
+        if (ptrs[i])
+        {
+            const uint8_t* p = (const uint8_t*)ptrs[i];
+            ASSERT_EQ(p[0], 0xCD);
+            ASSERT_EQ(p[elementSize - 1], 0xCD);
+        }
+    }
+
+    // released elements are re-armed on demand, the bucket capacity is not reduced
+    for (size_t i = 0; i < count; i++)
+    {
+        if (ptrs[i] == nullptr)
+        {
+            ptrs[i] = _sm_malloc(heap, elementSize, 1);
+            ASSERT_EQ(_sm_mbucket(heap, ptrs[i]), 0);
+            std::memset(ptrs[i], 0xAB, elementSize);
+        }
+    }
+
+    void* p = _sm_malloc(heap, elementSize, 1);
+    EXPECT_NE(_sm_mbucket(heap, p), 0);
+    _sm_free(heap, p);
+
+    for (size_t i = 0; i < count; i++)
+    {
+        _sm_free(heap, ptrs[i]);
+    }
+
+    // everything is free now, all pages of the bucket can be released
+    EXPECT_GT(_sm_allocator_trim(heap), (size_t)0);
+    _sm_allocator_destroy(heap);
+
+    // non-virtual arena can't be trimmed
+    heap = _sm_allocator_create(4, (4 * 1024 * 1024), sm::ALLOCATOR_DEFAULT);
+    p = _sm_malloc(heap, elementSize, 1);
+    _sm_free(heap, p);
+    EXPECT_EQ(_sm_allocator_trim(heap), (size_t)0);
+    _sm_allocator_destroy(heap);
+}
+
+TEST(SimpleTests, HugePages)
+{
+    sm_allocator heap = _sm_allocator_create(8, (3 * 1024 * 1024), sm::ALLOCATOR_HUGE_PAGES);
+    EXPECT_NE(heap->GetFlags() & sm::ALLOCATOR_VIRTUAL_ARENA, 0u);
+
+    const size_t hugePageSize = sm::VirtualMemory::GetHugePageSize();
+    for (int32_t bucketIndex = 0; bucketIndex < 8; bucketIndex++)
+    {
+        size_t elementSize = sm::GetBucketSizeInBytesByIndex(bucketIndex);
+
+        // bucket capacity is rounded up to the huge page size
+        EXPECT_EQ(heap->GetBucketElementsCount(bucketIndex), uint32_t(sm::Align(3 * 1024 * 1024, hugePageSize) / elementSize));
+
+        // the first element of the bucket starts at the huge page boundary
+        void* p = _sm_malloc(heap, elementSize, 1);
+        ASSERT_EQ(_sm_mbucket(heap, p), bucketIndex);
+        EXPECT_TRUE(sm::IsAligned(size_t(p), hugePageSize));
+
+        std::vector<void*> ptrs;
+        for (size_t i = 0; i < 4096; i++)
+        {
+            void* p2 = _sm_malloc(heap, elementSize, 1);
+            ASSERT_EQ(_sm_mbucket(heap, p2), bucketIndex);
+            std::memset(p2, 0xCD, elementSize);
+            ptrs.push_back(p2);
+        }
+
+        for (size_t i = 0; i < ptrs.size(); i++)
+        {
+            _sm_free(heap, ptrs[i]);
+        }
+        _sm_free(heap, p);
+    }
+    _sm_allocator_destroy(heap);
+}
+
+struct CountingBackend
+{
+    size_t allocCount = 0;
+    size_t freeCount = 0;
+    size_t reallocCount = 0;
+
+    // forward everything to the default backend
+    static void* Alloc(void* context, size_t bytesCount, size_t alignment)
+    {
+        ((CountingBackend*)context)->allocCount++;
+        return sm::GenericAllocator::Alloc(nullptr, bytesCount, alignment);
+    }
+
+    static void Free(void* context, void* p)
+    {
+        ((CountingBackend*)context)->freeCount++;
+        sm::GenericAllocator::Free(nullptr, p);
+    }
+
+    static void* Realloc(void* context, void* p, size_t bytesCount, size_t alignment)
+    {
+        ((CountingBackend*)context)->reallocCount++;
+        return sm::GenericAllocator::Realloc(nullptr, p, bytesCount, alignment);
+    }
+
+    static size_t UsableSize(void* context, void* p)
+    {
+        SMMALLOC_UNUSED(context);
+        return sm::GenericAllocator::GetUsableSpace(nullptr, p);
+    }
+};
+
+TEST(SimpleTests, CustomBackend)
+{
+    for (int withUsableSize = 0; withUsableSize < 2; withUsableSize++)
+    {
+        CountingBackend counters;
+        sm::GenericAllocator::Backend backend;
+        backend.context = &counters;
+        backend.alloc = &CountingBackend::Alloc;
+        backend.free = &CountingBackend::Free;
+        backend.realloc = withUsableSize ? &CountingBackend::Realloc : nullptr;
+        backend.usableSize = withUsableSize ? &CountingBackend::UsableSize : nullptr;
+
+        sm_allocator heap = _sm_allocator_create(4, (1024 * 1024), sm::ALLOCATOR_DEFAULT, &backend);
+        ASSERT_NE(heap, nullptr);
+        size_t allocCount = counters.allocCount;
+        EXPECT_GT(allocCount, (size_t)0);
+
+        // served by buckets
+        void* p = _sm_malloc(heap, 16, 16);
+        EXPECT_EQ(counters.allocCount, allocCount);
+        _sm_free(heap, p);
+
+        // routed to the backend
+        p = _sm_malloc(heap, 100000, 64);
+        EXPECT_EQ(counters.allocCount, allocCount + 1);
+        EXPECT_TRUE(IsAligned(p, 64));
+        EXPECT_GE(_sm_msize(heap, p), (size_t)100000);
+        std::memset(p, 0xCD, 100000);
+
+        p = _sm_realloc(heap, p, 200000, 256);
+        EXPECT_TRUE(IsAligned(p, 256));
+        EXPECT_GE(_sm_msize(heap, p), (size_t)200000);
+        EXPECT_EQ(((uint8_t*)p)[99999], 0xCD);
+        EXPECT_EQ(counters.reallocCount, size_t(withUsableSize));
+
+        _sm_free(heap, p);
+        _sm_allocator_destroy(heap);
+        EXPECT_EQ(counters.allocCount, counters.freeCount);
+    }
+}
+
+TEST(SimpleTests, LargeObjects)
+{
+    sm::GenericAllocator::TInstance instance = sm::GenericAllocator::Create();
+
+    // grow the buffer geometrically, the content must be preserved
+    size_t bytesCount = 64 * 1024;
+    uint8_t* p = (uint8_t*)sm::GenericAllocator::Alloc(instance, bytesCount, 64);
+    ASSERT_NE(p, nullptr);
+    EXPECT_TRUE(IsAligned(p, 64));
+    for (size_t i = 0; i < bytesCount; i++)
+    {
+        p[i] = uint8_t(i * 7);
+    }
+
+    while (bytesCount < 64 * 1024 * 1024)
+    {
+        size_t newBytesCount = bytesCount * 2;
+        p = (uint8_t*)sm::GenericAllocator::Realloc(instance, p, newBytesCount, 64);
+        ASSERT_NE(p, nullptr);
+        EXPECT_TRUE(IsAligned(p, 64));
+        EXPECT_EQ(sm::GenericAllocator::GetUsableSpace(instance, p), newBytesCount);
+        for (size_t i = bytesCount; i < newBytesCount; i++)
+        {
+            p[i] = uint8_t(i * 7);
+        }
+        bytesCount = newBytesCount;
+    }
+
+    for (size_t i = 0; i < bytesCount; i += 4093)
+    {
+        ASSERT_EQ(p[i], uint8_t(i * 7));
+    }
+
+    // shrink in place
+    uint8_t* p2 = (uint8_t*)sm::GenericAllocator::Realloc(instance, p, 1024 * 1024, 64);
+    EXPECT_EQ(p2, p);
+    EXPECT_EQ(sm::GenericAllocator::GetUsableSpace(instance, p2), (size_t)(1024 * 1024));
+    sm::GenericAllocator::Free(instance, p2);
+
+    // page aligned blocks
+    void* p3 = sm::GenericAllocator::Alloc(instance, 10000, 4096);
+    EXPECT_TRUE(IsAligned(p3, 4096));
+    std::memset(p3, 0xCD, 10000);
+    sm::GenericAllocator::Free(instance, p3);
+
+    // recently freed span is reused
+    void* p4 = sm::GenericAllocator::Alloc(instance, 300000, 16);
+    std::memset(p4, 0xCD, 300000);
+    sm::GenericAllocator::Free(instance, p4);
+    void* p5 = sm::GenericAllocator::Alloc(instance, 290000, 16);
+#if !defined(_WIN32)
+    EXPECT_EQ(p4, p5);
+#endif
+    sm::GenericAllocator::Free(instance, p5);
+}
+
+TEST(SimpleTests, PerBucketCapacity)
+{
+    std::array<uint32_t, 2> modes = {sm::ALLOCATOR_DEFAULT, sm::ALLOCATOR_VIRTUAL_ARENA};
+    for (uint32_t flags : modes)
+    {
+        std::array<size_t, 5> capacities = {20 * 1024 * 1024, 1024 * 1024, 64 * 1024, 12345, 3 * 1024 * 1024};
+        sm_allocator heap = _sm_allocator_create_ex({capacities[0], capacities[1], capacities[2], capacities[3], capacities[4]}, flags);
+        ASSERT_EQ(heap->GetBucketsCount(), capacities.size());
+
+        for (int32_t bucketIndex = 0; bucketIndex < (int32_t)capacities.size(); bucketIndex++)
+        {
+            size_t elementSize = sm::GetBucketSizeInBytesByIndex(bucketIndex);
+            size_t maxCount = heap->GetBucketElementsCount(bucketIndex);
+            EXPECT_GE(maxCount, capacities[bucketIndex] / elementSize);
+            EXPECT_LE(maxCount, (capacities[bucketIndex] + sm::VirtualMemory::GetPageSize()) / elementSize);
+
+            // every element of the bucket maps back to the bucket
+            std::vector<void*> ptrs;
+            for (;;)
+            {
+                void* p = _sm_malloc(heap, elementSize, 1);
+                ptrs.push_back(p);
+                if (_sm_mbucket(heap, p) != bucketIndex)
+                {
+                    break;
+                }
+                EXPECT_EQ(_sm_msize(heap, p), elementSize);
+            }
+            EXPECT_EQ(ptrs.size() - 1, maxCount);
+
+            for (size_t i = 0; i < ptrs.size(); i++)
+            {
+                _sm_free(heap, ptrs[i]);
+            }
+        }
+
+        // pointers outside of the arena
+        int localVariable = 0;
+        EXPECT_EQ(_sm_mbucket(heap, &localVariable), -1);
+        _sm_allocator_destroy(heap);
+    }
+}
+
+#ifdef SMMMALLOC_X64
+TEST(SimpleTests, BucketSizeLimit)
+{
+    // 6Gb bucket (address range is reserved, pages are committed on demand)
+    const uint64_t kCapacity = uint64_t(6) * 1024 * 1024 * 1024;
+    sm_allocator heap = _sm_allocator_create_ex({size_t(kCapacity)}, sm::ALLOCATOR_VIRTUAL_ARENA);
+    uint64_t capacity = uint64_t(heap->GetBucketElementsCount(0)) * sm::GetBucketSizeInBytesByIndex(0);
+#ifdef SMM_WIDE_OFFSETS
+    EXPECT_GE(capacity, kCapacity);
+#else
+    // bucket offsets are 32-bit
+    EXPECT_LT(capacity, uint64_t(4) * 1024 * 1024 * 1024);
+#endif
+
+    _sm_allocator_thread_cache_create(heap, sm::CACHE_WARM, {64});
+    std::vector<void*> ptrs;
+    for (int i = 0; i < 1000; i++)
+    {
+        void* p = _sm_malloc(heap, 16, 16);
+        EXPECT_EQ(_sm_mbucket(heap, p), 0);
+        ptrs.push_back(p);
+    }
+    for (size_t i = 0; i < ptrs.size(); i++)
+    {
+        _sm_free(heap, ptrs[i]);
+    }
+    _sm_allocator_thread_cache_destroy(heap);
+    _sm_allocator_destroy(heap);
+}
+#endif
+
+TEST(SimpleTests, ThreadCacheChainRefill)
+{
+    std::array<uint32_t, 2> modes = {sm::ALLOCATOR_DEFAULT, sm::ALLOCATOR_EAGER_INIT | sm::ALLOCATOR_SHARDED_BUCKETS};
+    for (uint32_t flags : modes)
+    {
+        sm_allocator heap = _sm_allocator_create_ex({256 * 1024}, flags);
+        _sm_allocator_thread_cache_create(heap, sm::CACHE_COLD, {256});
+        size_t elementsCount = heap->GetBucketElementsCount(0);
+
+        for (int pass = 0; pass < 3; pass++)
+        {
+            // cold cache is refilled from the bucket in chains, every element is handed out only once
+            std::vector<uint32_t*> ptrs;
+            for (;;)
+            {
+                uint32_t* p = (uint32_t*)_sm_malloc(heap, 16, 16);
+                if (_sm_mbucket(heap, p) != 0)
+                {
+                    _sm_free(heap, p);
+                    break;
+                }
+                p[0] = uint32_t(ptrs.size());
+                ptrs.push_back(p);
+            }
+            EXPECT_EQ(ptrs.size(), elementsCount);
+
+            for (size_t i = 0; i < ptrs.size(); i++)
+            {
+                ASSERT_EQ(ptrs[i][0], uint32_t(i));
+                _sm_free(heap, ptrs[i]);
+            }
+        }
+
+#ifdef SMMALLOC_STATS_SUPPORT
+        // most of the allocations are served by the thread cache
+        const sm::BucketStats* stats = heap->GetBucketStats(0);
+        EXPECT_GT(stats->cacheHitCount.load(), stats->hitCount.load() * 10);
+#endif
+
+        _sm_allocator_thread_cache_destroy(heap);
+        _sm_allocator_destroy(heap);
+    }
+}
+
+TEST(SimpleTests, PerCpuCache)
+{
+    sm_allocator heap = _sm_allocator_create(4, (4 * 1024 * 1024), sm::ALLOCATOR_PER_CPU_CACHE);
+#ifndef SMM_PER_CPU_CACHE_SUPPORT
+    EXPECT_EQ(heap->GetFlags() & sm::ALLOCATOR_PER_CPU_CACHE, 0u);
+#endif
+
+    // more elements than a single CPU can cache (stacks are refilled and drained many times)
+    for (int pass = 0; pass < 4; pass++)
+    {
+        std::vector<uint32_t*> ptrs;
+        for (uint32_t i = 0; i < SMM_PER_CPU_CACHE_ITEMS_COUNT * 8; i++)
+        {
+            uint32_t* p = (uint32_t*)_sm_malloc(heap, 16, 16);
+            ASSERT_EQ(_sm_mbucket(heap, p), 0);
+            p[0] = i;
+            p[3] = ~i;
+            ptrs.push_back(p);
+        }
+
+        for (uint32_t i = 0; i < (uint32_t)ptrs.size(); i++)
+        {
+            // every element is handed out only once
+            ASSERT_EQ(ptrs[i][0], i);
+            ASSERT_EQ(ptrs[i][3], ~i);
+            _sm_free(heap, ptrs[i]);
+        }
+    }
+
+    // batch allocation takes the elements cached by the current CPU first
+    void* cached = _sm_malloc(heap, 16, 16);
+    _sm_free(heap, cached);
+    std::vector<void*> batch(SMM_PER_CPU_CACHE_ITEMS_COUNT * 2, nullptr);
+    EXPECT_EQ(_sm_malloc_batch(heap, 16, 16, batch.size(), batch.data()), batch.size());
+    EXPECT_EQ(batch[0], cached);
+    for (void* p : batch)
+    {
+        EXPECT_EQ(_sm_mbucket(heap, p), 0);
+    }
+    _sm_free_batch(heap, batch.data(), batch.size());
+
+    // per CPU cache and thread cache can be used together
+    _sm_allocator_thread_cache_create(heap, sm::CACHE_WARM, {16, 16, 16, 16});
+    void* p = _sm_malloc(heap, 40, 8);
+    EXPECT_EQ(_sm_mbucket(heap, p), 2);
+    _sm_free(heap, p);
+    _sm_allocator_thread_cache_destroy(heap);
+
+    _sm_allocator_destroy(heap);
+}
+
+struct LinearConfig
+{
+    typedef sm::LinearPartitioning Partitioning;
+    static const size_t kBucketsCount = 8;
+    static const uint32_t kBucketSizeShift = 20;
+    static const uint32_t kFlags = sm::ALLOCATOR_DEFAULT;
+};
+
+struct FloatConfig
+{
+    typedef sm::FloatPartitioning Partitioning;
+    static const size_t kBucketsCount = 24;
+    static const uint32_t kBucketSizeShift = 21;
+    static const uint32_t kFlags = sm::ALLOCATOR_VIRTUAL_ARENA;
+};
+
+template <typename TConfig> void TestStaticAllocator()
+{
+    typedef sm::StaticAllocator<TConfig> TAllocator;
+    TAllocator allocator;
+    TAllocator* heap = &allocator;
+    EXPECT_EQ(heap->GetBucketsCount(), size_t(TConfig::kBucketsCount));
+
+    // every size is served by the bucket of the config partitioning scheme
+    for (size_t bytesCount = 1; bytesCount <= TAllocator::GetBucketSizeInBytesByIndex(TConfig::kBucketsCount - 1); bytesCount += 3)
+    {
+        size_t bucketIndex = TConfig::Partitioning::GetBucketIndexBySize(bytesCount);
+        void* p = heap->Alloc(bytesCount, 1);
+        ASSERT_EQ(heap->GetBucketIndex(p), (int32_t)bucketIndex);
+        ASSERT_EQ(heap->GetUsableSize(p), TAllocator::GetBucketSizeInBytesByIndex(bucketIndex));
+        std::memset(p, 0xCD, bytesCount);
+        heap->Free(p);
+    }
+
+    // exhaust the first bucket
+    size_t elementSize = TAllocator::GetBucketSizeInBytesByIndex(0);
+    std::vector<void*> ptrs;
+    for (;;)
+    {
+        void* p = heap->Alloc(elementSize, 1);
+        ptrs.push_back(p);
+        if (heap->GetBucketIndex(p) != 0)
+        {
+            break;
+        }
+    }
+    EXPECT_EQ(ptrs.size() - 1, heap->GetBucketElementsCount(0));
+    EXPECT_EQ(ptrs.size() - 1, (size_t(1) << TConfig::kBucketSizeShift) / elementSize);
+    for (size_t i = 0; i < ptrs.size(); i++)
+    {
+        heap->Free(ptrs[i]);
+    }
+
+    // grow from bucket to bucket and then to the generic allocator
+    heap->CreateThreadCache(sm::CACHE_WARM, {16, 16, 16, 16});
+    uint8_t* p = (uint8_t*)heap->Alloc(10, 16);
+    std::memset(p, 0x11, 10);
+    p = (uint8_t*)heap->Realloc(p, 100, 16);
+    EXPECT_TRUE(heap->IsMyAlloc(p));
+    EXPECT_EQ(p[9], 0x11);
+    p = (uint8_t*)heap->Realloc(p, 1024 * 1024, 16);
+    EXPECT_FALSE(heap->IsMyAlloc(p));
+    EXPECT_EQ(heap->GetBucketIndex(p), -1);
+    EXPECT_EQ(p[9], 0x11);
+    heap->Free(p);
+    heap->DestroyThreadCache();
+}
+
+TEST(SimpleTests, StaticAllocator)
+{
+    TestStaticAllocator<LinearConfig>();
+    TestStaticAllocator<FloatConfig>();
+}
+
+TEST(SimpleTests, MultipleAllocatorsThreadCache)
+{
+    std::array<sm_allocator, 3> heaps;
+    for (sm_allocator& heap : heaps)
+    {
+        heap = _sm_allocator_create(4, (1024 * 1024));
+        _sm_allocator_thread_cache_create(heap, sm::CACHE_WARM, {64, 64, 64, 64});
+    }
+
+    for (int pass = 0; pass < 4; pass++)
+    {
+        // every allocator has its own cache, elements always come back to the allocator they belong to
+        std::vector<void*> ptrs;
+        for (size_t i = 0; i < 3000; i++)
+        {
+            sm_allocator heap = heaps[i % heaps.size()];
+            void* p = _sm_malloc(heap, 16 + ((i / heaps.size()) % 48), 16);
+            ASSERT_TRUE(heap->IsMyAlloc(p));
+            ptrs.push_back(p);
+        }
+
+        for (size_t i = ptrs.size(); i > 0; i--)
+        {
+            _sm_free(heaps[(i - 1) % heaps.size()], ptrs[i - 1]);
+        }
+    }
+
+#ifdef SMMALLOC_STATS_SUPPORT
+    for (sm_allocator heap : heaps)
+    {
+        const sm::BucketStats* stats = heap->GetBucketStats(0);
+        EXPECT_GT(stats->cacheHitCount.load(), stats->hitCount.load());
+    }
+#endif
+
+    for (sm_allocator heap : heaps)
+    {
+        _sm_allocator_thread_cache_destroy(heap);
+        _sm_allocator_destroy(heap);
+    }
+}
+
+static void AllocFreeLoop(sm_allocator heap, size_t bytesCount, size_t count, int passesCount)
+{
+    std::vector<void*> ptrs;
+    for (int pass = 0; pass < passesCount; pass++)
+    {
+        for (size_t i = 0; i < count; i++)
+        {
+            ptrs.push_back(_sm_malloc(heap, bytesCount, 16));
+        }
+        for (void* p : ptrs)
+        {
+            _sm_free(heap, p);
+        }
+        ptrs.clear();
+    }
+}
+
+TEST(SimpleTests, AdaptiveThreadCache)
+{
+    {
+        sm_allocator heap = _sm_allocator_create(4, (4 * 1024 * 1024), sm::ALLOCATOR_ADAPTIVE_THREAD_CACHE);
+        _sm_allocator_thread_cache_create(heap, sm::CACHE_COLD, {4096, 4096, 4096, 4096});
+
+        // capacities start small
+        for (size_t i = 0; i < 4; i++)
+        {
+            EXPECT_LT(heap->GetThreadCacheCapacity(i), size_t(4096));
+        }
+
+        // hot bucket grows up to the working set size, idle ones stay small
+        AllocFreeLoop(heap, 16, 1000, 10);
+        EXPECT_GE(heap->GetThreadCacheCapacity(0), size_t(1000));
+        EXPECT_LE(heap->GetThreadCacheCapacity(0), size_t(4096));
+        EXPECT_LT(heap->GetThreadCacheCapacity(1), size_t(1000));
+
+        // long streams of frees shrink the cache
+        AllocFreeLoop(heap, 16, 20000, 1);
+        EXPECT_LT(heap->GetThreadCacheCapacity(0), size_t(4096));
+
+#ifdef SMMALLOC_STATS_SUPPORT
+        const sm::BucketStats* stats = heap->GetBucketStats(0);
+        EXPECT_GT(stats->cacheGrowCount.load(), size_t(0));
+        EXPECT_GT(stats->cacheShrinkCount.load(), size_t(0));
+#endif
+
+        _sm_allocator_thread_cache_destroy(heap);
+        EXPECT_EQ(heap->GetThreadCacheCapacity(0), size_t(0));
+        _sm_allocator_destroy(heap);
+    }
+
+    {
+        // all buckets share the same byte budget
+        const size_t budget = 16 * 1024;
+        sm_allocator heap = _sm_allocator_create(4, (4 * 1024 * 1024), sm::ALLOCATOR_ADAPTIVE_THREAD_CACHE);
+        heap->SetThreadCacheBudget(budget);
+        _sm_allocator_thread_cache_create(heap, sm::CACHE_COLD, {4096, 4096, 4096, 4096});
+
+        for (int pass = 0; pass < 4; pass++)
+        {
+            AllocFreeLoop(heap, 16, 1000, 4);
+            AllocFreeLoop(heap, 64, 1000, 4);
+        }
+
+        size_t usedBytes = 0;
+        for (size_t i = 0; i < 4; i++)
+        {
+            usedBytes += heap->GetThreadCacheCapacity(i) * sm::GetBucketSizeInBytesByIndex(i);
+        }
+        EXPECT_LE(usedBytes, budget);
+
+        _sm_allocator_thread_cache_destroy(heap);
+        _sm_allocator_destroy(heap);
+    }
+}
+
+TEST(SimpleTests, IncrementalFlush)
+{
+    for (uint32_t flags : {uint32_t(sm::ALLOCATOR_INCREMENTAL_FLUSH), uint32_t(sm::ALLOCATOR_INCREMENTAL_FLUSH | sm::ALLOCATOR_ADAPTIVE_THREAD_CACHE)})
+    {
+        sm_allocator heap = _sm_allocator_create(2, (1024 * 1024), flags);
+        size_t elementsCount = heap->GetBucketElementsCount(0);
+
+        if ((flags & sm::ALLOCATOR_ADAPTIVE_THREAD_CACHE) == 0)
+        {
+            // free burst overflows the cache, the next frees keep draining it (to half of the capacity, not below)
+            const uint32_t capacity = 8192;
+            sm_thread_cache cache = _sm_thread_cache_create(heap, sm::CACHE_COLD, {capacity});
+            size_t drainFreesCount = (capacity / 4) / (SMM_INCREMENTAL_FLUSH_CHUNK - 1) + 1;
+            std::vector<void*> ptrs;
+            for (size_t i = 0; i < capacity + SMM_MAX_CACHE_ITEMS_COUNT + 1 + drainFreesCount; i++)
+            {
+                ptrs.push_back(_sm_malloc(heap, 16, 16));
+            }
+            for (void* p : ptrs)
+            {
+                _sm_free_cache(heap, cache, p);
+            }
+            ptrs.clear();
+
+            // everything that is not in the bucket is in the cache
+            for (size_t i = 0; i <= elementsCount; i++)
+            {
+                void* p = _sm_malloc(heap, 16, 16);
+                ptrs.push_back(p);
+                if (_sm_mbucket(heap, p) != 0)
+                {
+                    break;
+                }
+            }
+            size_t cachedCount = elementsCount - (ptrs.size() - 1);
+            EXPECT_GE(cachedCount, size_t(capacity / 2));
+            EXPECT_LE(cachedCount, size_t(capacity / 4 * 3 + SMM_MAX_CACHE_ITEMS_COUNT));
+            for (void* p : ptrs)
+            {
+                _sm_free(heap, p);
+            }
+            _sm_thread_cache_destroy(heap, cache);
+        }
+
+        _sm_allocator_thread_cache_create(heap, sm::CACHE_COLD, {8192, 16});
+        AllocFreeLoop(heap, 16, 20000, 3);
+        AllocFreeLoop(heap, 16, 100, 100);
+
+        // nothing is lost
+        _sm_allocator_thread_cache_destroy(heap);
+        std::vector<void*> ptrs;
+        size_t bucketCount = 0;
+        for (size_t i = 0; i <= elementsCount; i++)
+        {
+            void* p = _sm_malloc(heap, 16, 16);
+            bucketCount += (_sm_mbucket(heap, p) == 0) ? 1 : 0;
+            ptrs.push_back(p);
+        }
+        EXPECT_EQ(bucketCount, elementsCount);
+        for (void* p : ptrs)
+        {
+            _sm_free(heap, p);
+        }
+
+        _sm_allocator_destroy(heap);
+    }
+}
+
+TEST(SimpleTests, ExplicitThreadCache)
+{
+    sm_allocator heap = _sm_allocator_create(4, (4 * 1024 * 1024));
+    sm_thread_cache cache = _sm_thread_cache_create(heap, sm::CACHE_WARM, {1024, 1024, 1024, 1024});
+    ASSERT_NE(cache, nullptr);
+
+    std::vector<void*> ptrs;
+    for (int pass = 0; pass < 4; pass++)
+    {
+        for (size_t i = 0; i < 2000; i++)
+        {
+            size_t bytesCount = 16 + (i % 48);
+            void* p = _sm_malloc_cache(heap, cache, bytesCount, 16);
+            ASSERT_TRUE(heap->IsMyAlloc(p));
+            std::memset(p, int(i), bytesCount);
+            ptrs.push_back(p);
+        }
+        for (void* p : ptrs)
+        {
+            _sm_free_cache(heap, cache, p);
+        }
+        ptrs.clear();
+    }
+
+    // explicit cache is not the thread cache
+    EXPECT_EQ(heap->GetThreadCacheCapacity(0), size_t(0));
+
+#ifdef SMMALLOC_STATS_SUPPORT
+    EXPECT_GT(heap->GetBucketStats(0)->cacheHitCount.load(), size_t(0));
+#endif
+
+    // destroyed cache returns all elements
+    _sm_thread_cache_destroy(heap, cache);
+    size_t elementsCount = heap->GetBucketElementsCount(0);
+    size_t bucketCount = 0;
+    for (size_t i = 0; i <= elementsCount; i++)
+    {
+        void* p = _sm_malloc(heap, 16, 16);
+        bucketCount += (_sm_mbucket(heap, p) == 0) ? 1 : 0;
+        ptrs.push_back(p);
+    }
+    EXPECT_EQ(bucketCount, elementsCount);
+    for (void* p : ptrs)
+    {
+        _sm_free(heap, p);
+    }
+
+    _sm_allocator_destroy(heap);
+}
+
+TEST(SimpleTests, MallocBatch)
+{
+    sm_allocator heap = _sm_allocator_create(4, (64 * 1024));
+    _sm_allocator_thread_cache_create(heap, sm::CACHE_HOT, {100, 100, 100, 100});
+
+    // thread cache, bucket chains and fallback to the generic allocator (the bucket has 2048 elements)
+    const size_t count = 3000;
+    std::vector<void*> ptrs(count, nullptr);
+    for (size_t bytesCount : {size_t(1), size_t(32), size_t(60), size_t(1000)})
+    {
+        EXPECT_EQ(_sm_malloc_batch(heap, bytesCount, 16, count, ptrs.data()), count);
+
+        size_t bucketCount = 0;
+        for (void* p : ptrs)
+        {
+            ASSERT_NE(p, nullptr);
+            EXPECT_TRUE(IsAligned(p, 16));
+            bucketCount += heap->IsMyAlloc(p) ? 1 : 0;
+            std::memset(p, 33, bytesCount);
+        }
+
+        // all pointers are unique
+        std::vector<void*> sorted(ptrs);
+        std::sort(sorted.begin(), sorted.end());
+        EXPECT_TRUE(std::adjacent_find(sorted.begin(), sorted.end()) == sorted.end());
+
+        // exhausted bucket overflows to the larger ones
+        if (bytesCount <= 64)
+        {
+            size_t bucketIndex = (bytesCount - 1) / 16;
+            EXPECT_GE(bucketCount, std::min(count, size_t(heap->GetBucketElementsCount(bucketIndex))));
+            for (void* p : ptrs)
+            {
+                EXPECT_TRUE(!heap->IsMyAlloc(p) || _sm_mbucket(heap, p) >= int32_t(bucketIndex));
+            }
+        }
+        else
+        {
+            EXPECT_EQ(bucketCount, size_t(0));
+        }
+
+        for (void* p : ptrs)
+        {
+            _sm_free(heap, p);
+        }
+    }
+
+    // zero size
+    EXPECT_EQ(_sm_malloc_batch(heap, 0, 16, 4, ptrs.data()), size_t(4));
+
+    // failed allocations are not counted and leave nullptr in the tail of 'out'
+    std::fill(ptrs.begin(), ptrs.begin() + 4, (void*)&heap);
+    EXPECT_EQ(_sm_malloc_batch(heap, size_t(1) << 62, 16, 4, ptrs.data()), size_t(0));
+    for (size_t i = 0; i < 4; i++)
+    {
+        EXPECT_EQ(ptrs[i], nullptr);
+    }
+
+    _sm_allocator_thread_cache_destroy(heap);
+    _sm_allocator_destroy(heap);
+}
+
+TEST(SimpleTests, FreeBatch)
+{
+    sm_allocator heap = _sm_allocator_create(4, (64 * 1024));
+    _sm_allocator_thread_cache_create(heap, sm::CACHE_COLD, {100, 100, 100, 100});
+
+    for (int pass = 0; pass < 4; pass++)
+    {
+        // mixed sizes (including generic allocator ones and zero sized allocations)
+        std::vector<void*> ptrs;
+        for (size_t i = 0; i < 3000; i++)
+        {
+            size_t bytesCount = (i % 7 == 0) ? 1000 : (i % 65);
+            void* p = _sm_malloc(heap, bytesCount, 16);
+            std::memset(p, 33, bytesCount);
+            ptrs.push_back(p);
+        }
+        ptrs.push_back(nullptr);
+        _sm_free_batch(heap, ptrs.data(), ptrs.size());
+    }
+
+    // overflow of the cache is back in the buckets, the rest is returned by the cache
+    _sm_allocator_thread_cache_destroy(heap);
+    for (size_t bucketIndex = 0; bucketIndex < heap->GetBucketsCount(); bucketIndex++)
+    {
+        size_t elementsCount = heap->GetBucketElementsCount(bucketIndex);
+        std::vector<void*> ptrs(elementsCount, nullptr);
+        size_t bytesCount = sm::GetBucketSizeInBytesByIndex(bucketIndex);
+        for (void*& p : ptrs)
+        {
+            p = _sm_malloc(heap, bytesCount, 16);
+            EXPECT_EQ(_sm_mbucket(heap, p), int32_t(bucketIndex));
+        }
+        _sm_free_batch(heap, ptrs.data(), ptrs.size());
+    }
+
+    _sm_allocator_destroy(heap);
+}
+
+TEST(SimpleTests, FreeSized)
+{
+    sm_allocator heap = _sm_allocator_create(4, (64 * 1024));
+    _sm_allocator_thread_cache_create(heap, sm::CACHE_COLD, {100, 100, 100, 100});
+
+    for (int pass = 0; pass < 4; pass++)
+    {
+        // more 16 bytes allocations than the first bucket can hold (overflow to the next buckets and to the generic allocator)
+        std::vector<std::pair<void*, size_t>> ptrs;
+        for (size_t i = 0; i < 6000; i++)
+        {
+            size_t bytesCount = (i % 5 == 0) ? 1000 : ((i % 3 == 0) ? (1 + i % 48) : 16);
+            void* p = _sm_malloc(heap, bytesCount, 16);
+            std::memset(p, 33, bytesCount);
+            ptrs.push_back(std::make_pair(p, bytesCount));
+        }
+        _sm_free_sized(heap, _sm_malloc(heap, 0, 16), 0, 16);
+        for (const auto& it : ptrs)
+        {
+            _sm_free_sized(heap, it.first, it.second, 16);
+        }
+    }
+
+    // every element is back (nothing is lost or freed into the wrong bucket)
+    _sm_allocator_thread_cache_destroy(heap);
+    for (size_t bucketIndex = 0; bucketIndex < heap->GetBucketsCount(); bucketIndex++)
+    {
+        size_t elementsCount = heap->GetBucketElementsCount(bucketIndex);
+        std::vector<void*> ptrs(elementsCount, nullptr);
+        size_t bytesCount = sm::GetBucketSizeInBytesByIndex(bucketIndex);
+        for (void*& p : ptrs)
+        {
+            p = _sm_malloc(heap, bytesCount, 16);
+            EXPECT_EQ(_sm_mbucket(heap, p), int32_t(bucketIndex));
+        }
+        for (void* p : ptrs)
+        {
+            _sm_free_sized(heap, p, bytesCount, 16);
+        }
+    }
+
+    _sm_allocator_destroy(heap);
+}
@@ -1,4 +1,5 @@
 #include <array>
+#include <chrono>
 #include <gtest/gtest.h>
 #include <inttypes.h>
 #include <smmalloc.h>
@@ -120,16 +121,14 @@ TEST(MultithreadingTests, StressTest)
 
 std::atomic<uint64_t> operationsCount;
 
-void ThreadFunc2(sm_allocator heap)
+void ThreadFunc2(sm_allocator heap, bool useThreadCache, int iterationsCount)
 {
     SM_ASSERT(heap != nullptr);
-    _sm_allocator_thread_cache_create(heap, sm::CACHE_WARM, {2048, 2048, 2048, 2048, 2048, 2048, 2048, 2048, 2048, 2048});
+    if (useThreadCache)
+    {
+        _sm_allocator_thread_cache_create(heap, sm::CACHE_WARM, {2048, 2048, 2048, 2048, 2048, 2048, 2048, 2048, 2048, 2048});
+    }
 
-#ifdef _DEBUG
-    int iterationsCount = 2;
-#else
-    int iterationsCount = 1024 * 100;
-#endif
     size_t opCount = 0;
     for (int pass = 0; pass < iterationsCount; pass++)
     {
@@ -153,7 +152,31 @@ void ThreadFunc2(sm_allocator heap)
     }
 
     operationsCount.fetch_add(opCount, std::memory_order_relaxed);
-    _sm_allocator_thread_cache_destroy(heap);
+    if (useThreadCache)
+    {
+        _sm_allocator_thread_cache_destroy(heap);
+    }
+}
+
+// wall clock operations per second
+double MeasureMtPerformance(sm_allocator heap, int threadsCount, bool useThreadCache, int iterationsCount)
+{
+    operationsCount.store(0);
+    auto start = std::chrono::steady_clock::now();
+
+    std::vector<std::thread> threads;
+    for (int i = 0; i < threadsCount; i++)
+    {
+        threads.push_back(std::thread(ThreadFunc2, heap, useThreadCache, iterationsCount));
+    }
+
+    for (auto& t : threads)
+    {
+        t.join();
+    }
+
+    double sec = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    return double(operationsCount.load()) / sec;
 }
 
 TEST(MultithreadingTests, MtPerformance)
@@ -170,10 +193,16 @@ TEST(MultithreadingTests, MtPerformance)
 
     clock_t start = clock();
 
+#ifdef _DEBUG
+    int iterationsCount = 2;
+#else
+    int iterationsCount = 1024 * 100;
+#endif
+
     std::vector<std::thread> threads;
     for (int i = 0; i < threadsCount; i++)
     {
-        threads.push_back(std::thread(ThreadFunc2, heap));
+        threads.push_back(std::thread(ThreadFunc2, heap, true, iterationsCount));
     }
 
     // wait all threads
@@ -218,4 +247,770 @@ TEST(MultithreadingTests, MtPerformance)
     }
 #endif
     _sm_allocator_destroy(heap);
+
+    // scaling with and without thread caches / sharded bucket free lists
+#ifdef _DEBUG
+    iterationsCount = 2;
+#else
+    iterationsCount = 1024 * 4;
+#endif
+    printf("threads\tcache\tsharded\tops/sec\n");
+    for (int useThreadCache = 1; useThreadCache >= 0; useThreadCache--)
+    {
+        for (uint32_t flags : {uint32_t(sm::ALLOCATOR_DEFAULT), uint32_t(sm::ALLOCATOR_SHARDED_BUCKETS)})
+        {
+            for (int numThreads = 1; numThreads <= threadsCount; numThreads++)
+            {
+                heap = _sm_allocator_create(10, (48 * 1024 * 1024), flags);
+                double opsPerSec = MeasureMtPerformance(heap, numThreads, useThreadCache != 0, iterationsCount);
+                printf("%d\t%s\t%s\t%3.2f\n", numThreads, useThreadCache ? "yes" : "no", (flags & sm::ALLOCATOR_SHARDED_BUCKETS) ? "yes" : "no",
+                       opsPerSec);
+                _sm_allocator_destroy(heap);
+            }
+        }
+    }
+}
+
+std::atomic<uint32_t> activeThreadsCount;
+
+void ThreadFunc3(sm_allocator heap)
+{
+    SM_ASSERT(heap != nullptr);
+#ifdef _DEBUG
+    int iterationsCount = 64;
+#else
+    int iterationsCount = 1024;
+#endif
+    for (int pass = 0; pass < iterationsCount; pass++)
+    {
+        std::array<void*, 1024> workingSet;
+        for (size_t i = 0; i < workingSet.size(); i++)
+        {
+            size_t bytesCount = 16 + (rand() % 240);
+            void* p = _sm_malloc(heap, bytesCount, 16);
+            workingSet[i] = p;
+            std::memset(p, int(i & 0xFF), bytesCount);
+        }
+
+        for (size_t i = 0; i < workingSet.size(); i++)
+        {
+            uint8_t* p = (uint8_t*)workingSet[i];
+            EXPECT_EQ(p[0], uint8_t(i & 0xFF));
+            EXPECT_EQ(p[15], uint8_t(i & 0xFF));
+            _sm_free(heap, p);
+        }
+    }
+    activeThreadsCount.fetch_sub(1);
+}
+
+TEST(MultithreadingTests, ConcurrentTrim)
+{
+    sm_allocator heap = _sm_allocator_create(10, (16 * 1024 * 1024), sm::ALLOCATOR_VIRTUAL_ARENA);
+
+    int threadsCount = std::min(4, int(std::thread::hardware_concurrency()));
+    activeThreadsCount.store(threadsCount);
+
+    std::vector<std::thread> threads;
+    for (int i = 0; i < threadsCount; i++)
+    {
+        threads.push_back(std::thread(ThreadFunc3, heap));
+    }
+
+    // trim while other threads allocate and free memory
+    size_t releasedBytes = 0;
+    while (activeThreadsCount.load() > 0)
+    {
+        releasedBytes += _sm_allocator_trim(heap);
+        std::this_thread::yield();
+    }
+
+    for (auto& t : threads)
+    {
+        t.join();
+    }
+    printf("%zu bytes released\n", releasedBytes);
+
+    // no element can be lost
+    size_t bucketsCount = heap->GetBucketsCount();
+    std::vector<void*> ptrs;
+    for (int32_t bucketIndex = 0; bucketIndex < (int32_t)bucketsCount; bucketIndex++)
+    {
+        size_t elementSize = sm::GetBucketSizeInBytesByIndex(bucketIndex);
+        size_t availCount = 0;
+        for (;; availCount++)
+        {
+            void* p = _sm_malloc(heap, elementSize, 1);
+            ptrs.push_back(p);
+            if (_sm_mbucket(heap, p) != bucketIndex)
+            {
+                break;
+            }
+        }
+        EXPECT_EQ(availCount, heap->GetBucketElementsCount(bucketIndex));
+
+        for (size_t i = 0; i < ptrs.size(); i++)
+        {
+            _sm_free(heap, ptrs[i]);
+        }
+        ptrs.clear();
+    }
+
+    _sm_allocator_destroy(heap);
+}
+
+void TrimmedBucketFunc(sm_allocator heap, size_t elementSize)
+{
+#ifdef _DEBUG
+    int iterationsCount = 256;
+#else
+    int iterationsCount = 4096;
+#endif
+    for (int pass = 0; pass < iterationsCount; pass++)
+    {
+        std::array<void*, 256> workingSet;
+        for (size_t i = 0; i < workingSet.size(); i++)
+        {
+            workingSet[i] = _sm_malloc(heap, elementSize, 1);
+            EXPECT_EQ(_sm_mbucket(heap, workingSet[i]), 0);
+        }
+
+        for (size_t i = 0; i < workingSet.size(); i++)
+        {
+            _sm_free(heap, workingSet[i]);
+        }
+    }
+    activeThreadsCount.fetch_sub(1);
+}
+
+TEST(MultithreadingTests, ConcurrentTrimDoesNotGrow)
+{
+    sm_allocator heap = _sm_allocator_create(4, (256 * 1024), sm::ALLOCATOR_GROWABLE_BUCKETS);
+
+    // use the whole frontier, all elements are in the free list now
+    size_t elementSize = sm::GetBucketSizeInBytesByIndex(0);
+    size_t elementsCount = heap->GetBucketElementsCount(0);
+    std::vector<void*> ptrs(elementsCount);
+    for (size_t i = 0; i < elementsCount; i++)
+    {
+        ptrs[i] = _sm_malloc(heap, elementSize, 1);
+    }
+    for (size_t i = 0; i < elementsCount; i++)
+    {
+        _sm_free(heap, ptrs[i]);
+    }
+
+    int threadsCount = 4;
+    activeThreadsCount.store(threadsCount);
+
+    std::vector<std::thread> threads;
+    for (int i = 0; i < threadsCount; i++)
+    {
+        threads.push_back(std::thread(TrimmedBucketFunc, heap, elementSize));
+    }
+
+    // lists detached by the trim must not look like an exhausted bucket
+    while (activeThreadsCount.load() > 0)
+    {
+        _sm_allocator_trim(heap);
+        std::this_thread::yield();
+    }
+
+    for (auto& t : threads)
+    {
+        t.join();
+    }
+
+    EXPECT_EQ(heap->GetBucketElementsCount(0), elementsCount);
+    _sm_allocator_destroy(heap);
+}
+
+void OverwrittenChainsFunc(sm_allocator heap, size_t elementSize, bool useThreadCache)
+{
+    // thread cache refills walk the free list without owning it (and can read the user data of elements taken by other threads)
+    if (useThreadCache)
+    {
+        _sm_allocator_thread_cache_create(heap, sm::CACHE_COLD, {16});
+    }
+
+#ifdef _DEBUG
+    int iterationsCount = 1024;
+#else
+    int iterationsCount = 16384;
+#endif
+    for (int pass = 0; pass < iterationsCount; pass++)
+    {
+        std::array<uint8_t*, 64> workingSet;
+        for (size_t i = 0; i < workingSet.size(); i++)
+        {
+            uint8_t* p = (uint8_t*)_sm_malloc(heap, elementSize, 1);
+            ASSERT_EQ(_sm_mbucket(heap, p), 0);
+
+            // 0xFF bytes, the lowest byte of every word is 0xF0 (offset + element size wraps around to zero)
+            std::memset(p, 0xFF, elementSize);
+            for (size_t j = 0; j < elementSize; j += sizeof(sm::internal::ElementOffset))
+            {
+                p[j] = 0xF0;
+            }
+            workingSet[i] = p;
+        }
+
+        for (size_t i = 0; i < workingSet.size(); i++)
+        {
+            _sm_free(heap, workingSet[i]);
+        }
+    }
+
+    if (useThreadCache)
+    {
+        _sm_allocator_thread_cache_destroy(heap);
+    }
+}
+
+TEST(MultithreadingTests, OverwrittenChainElements)
+{
+    sm_allocator heap = _sm_allocator_create(1, (64 * 1024));
+    size_t elementSize = sm::GetBucketSizeInBytesByIndex(0);
+
+    std::vector<std::thread> threads;
+    for (int i = 0; i < 4; i++)
+    {
+        threads.push_back(std::thread(OverwrittenChainsFunc, heap, elementSize, (i & 1) == 0));
+    }
+    for (auto& t : threads)
+    {
+        t.join();
+    }
+
+    _sm_allocator_destroy(heap);
+}
+
+void ThreadFunc4(sm_allocator heap, uint8_t threadIndex)
+{
+    SM_ASSERT(heap != nullptr);
+#ifdef _DEBUG
+    int iterationsCount = 64;
+#else
+    int iterationsCount = 512;
+#endif
+    for (int pass = 0; pass < iterationsCount; pass++)
+    {
+        std::array<std::pair<uint8_t*, size_t>, 1024> workingSet;
+        for (size_t i = 0; i < workingSet.size(); i++)
+        {
+            size_t bytesCount = 16 + (rand() % 240);
+            uint8_t* p = (uint8_t*)_sm_malloc(heap, bytesCount, 16);
+            workingSet[i] = std::make_pair(p, bytesCount);
+            std::memset(p, threadIndex, bytesCount);
+        }
+
+        for (size_t i = 0; i < workingSet.size(); i++)
+        {
+            // element must not be shared with another thread
+            uint8_t* p = workingSet[i].first;
+            size_t bytesCount = workingSet[i].second;
+            for (size_t j = 0; j < bytesCount; j++)
+            {
+                ASSERT_EQ(p[j], threadIndex);
+            }
+            _sm_free(heap, p);
+        }
+    }
+}
+
+TEST(MultithreadingTests, PerCpuCacheStress)
+{
+    sm_allocator heap = _sm_allocator_create(15, (16 * 1024 * 1024), sm::ALLOCATOR_PER_CPU_CACHE);
+
+    // more threads than CPUs to make threads preempt each other inside restartable sequences
+    int threadsCount = std::max(8, int(std::thread::hardware_concurrency()) * 2);
+#ifdef _DEBUG
+    threadsCount = std::min(threadsCount, 8);
+#endif
+
+    std::vector<std::thread> threads;
+    for (int i = 0; i < threadsCount; i++)
+    {
+        threads.push_back(std::thread(ThreadFunc4, heap, uint8_t(i + 1)));
+    }
+
+    for (auto& t : threads)
+    {
+        t.join();
+    }
+
+    _sm_allocator_destroy(heap);
+}
+
+// single producer single consumer ring of pointers
+struct MessageQueue
+{
+    static const size_t kCapacity = 4096;
+    std::array<void*, kCapacity> slots;
+    std::atomic<size_t> head;
+    std::atomic<size_t> tail;
+
+    MessageQueue()
+        : head(0)
+        , tail(0)
+    {
+    }
+
+    bool Push(void* p)
+    {
+        size_t t = tail.load(std::memory_order_relaxed);
+        if (t - head.load(std::memory_order_acquire) == kCapacity)
+        {
+            return false;
+        }
+        slots[t % kCapacity] = p;
+        tail.store(t + 1, std::memory_order_release);
+        return true;
+    }
+
+    void* Pop()
+    {
+        size_t h = head.load(std::memory_order_relaxed);
+        if (h == tail.load(std::memory_order_acquire))
+        {
+            return nullptr;
+        }
+        void* p = slots[h % kCapacity];
+        head.store(h + 1, std::memory_order_release);
+        return p;
+    }
+};
+
+void ProducerFunc(sm_allocator heap, MessageQueue* queue, size_t messagesCount)
+{
+    _sm_allocator_thread_cache_create(heap, sm::CACHE_COLD, {1024});
+    for (size_t i = 0; i < messagesCount; i++)
+    {
+        size_t* p = (size_t*)_sm_malloc(heap, 16, 16);
+        p[0] = i;
+        p[1] = ~i;
+        while (!queue->Push(p))
+        {
+            std::this_thread::yield();
+        }
+    }
+    _sm_allocator_thread_cache_destroy(heap);
+}
+
+void ConsumerFunc(sm_allocator heap, MessageQueue* queue, size_t messagesCount)
+{
+    _sm_allocator_thread_cache_create(heap, sm::CACHE_COLD, {1024});
+    for (size_t i = 0; i < messagesCount; i++)
+    {
+        size_t* p = nullptr;
+        while ((p = (size_t*)queue->Pop()) == nullptr)
+        {
+            std::this_thread::yield();
+        }
+        ASSERT_EQ(p[0], i);
+        ASSERT_EQ(p[1], ~i);
+        _sm_free(heap, p);
+    }
+    _sm_allocator_thread_cache_destroy(heap);
+}
+
+TEST(MultithreadingTests, ProducerConsumer)
+{
+#ifdef _DEBUG
+    size_t messagesCount = 200000;
+#else
+    size_t messagesCount = 4000000;
+#endif
+
+    printf("flags\tops/sec\n");
+    for (uint32_t flags : {uint32_t(sm::ALLOCATOR_DEFAULT), uint32_t(sm::ALLOCATOR_RETURN_CHANNELS),
+                           uint32_t(sm::ALLOCATOR_RETURN_CHANNELS | sm::ALLOCATOR_SHARDED_BUCKETS)})
+    {
+        sm_allocator heap = _sm_allocator_create(1, (16 * 1024 * 1024), flags);
+        MessageQueue queue;
+
+        auto start = std::chrono::steady_clock::now();
+        std::thread producer(ProducerFunc, heap, &queue, messagesCount);
+        std::thread consumer(ConsumerFunc, heap, &queue, messagesCount);
+        producer.join();
+        consumer.join();
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        printf("%u\t%.2f\n", flags, double(messagesCount) / seconds);
+
+#ifdef SMMALLOC_STATS_SUPPORT
+        // freed elements go back to the producer cache in batches
+        const sm::BucketStats* stats = heap->GetBucketStats(0);
+        ASSERT_NE(stats, nullptr);
+        EXPECT_EQ(stats->hitCount.load() + stats->cacheHitCount.load(), messagesCount);
+        if (flags & sm::ALLOCATOR_RETURN_CHANNELS)
+        {
+            EXPECT_GT(stats->returnChannelHitCount.load(), size_t(0));
+        }
+#endif
+
+        _sm_allocator_destroy(heap);
+    }
+}
+
+void ThreadFunc5(sm_allocator heap, size_t allocationsCount)
+{
+    // no explicit thread cache create/destroy
+    std::vector<void*> ptrs;
+    for (size_t i = 0; i < allocationsCount; i++)
+    {
+        ptrs.push_back(_sm_malloc(heap, 16, 16));
+        EXPECT_EQ(_sm_mbucket(heap, ptrs.back()), 0);
+    }
+    for (void* p : ptrs)
+    {
+        _sm_free(heap, p);
+    }
+}
+
+TEST(MultithreadingTests, AutoThreadCache)
+{
+    sm_allocator heap = _sm_allocator_create(1, (64 * 1024));
+    _sm_allocator_thread_cache_auto(heap, sm::CACHE_COLD, {512});
+    size_t elementsCount = heap->GetBucketElementsCount(0);
+
+    for (int pass = 0; pass < 4; pass++)
+    {
+        std::vector<std::thread> threads;
+        for (int i = 0; i < 4; i++)
+        {
+            threads.push_back(std::thread(ThreadFunc5, heap, elementsCount / 8));
+        }
+
+        for (auto& t : threads)
+        {
+            t.join();
+        }
+    }
+
+#ifdef SMMALLOC_STATS_SUPPORT
+    // threads got caches on the first allocation
+    const sm::BucketStats* stats = heap->GetBucketStats(0);
+    EXPECT_GT(stats->cacheHitCount.load(), stats->hitCount.load());
+#endif
+
+    // caches were flushed on thread exit, every element of the bucket can be allocated again
+    _sm_allocator_thread_cache_auto(heap, sm::CACHE_COLD, {});
+    std::vector<void*> ptrs;
+    for (size_t i = 0; i < elementsCount; i++)
+    {
+        ptrs.push_back(_sm_malloc(heap, 16, 16));
+        ASSERT_EQ(_sm_mbucket(heap, ptrs.back()), 0);
+    }
+    for (void* p : ptrs)
+    {
+        _sm_free(heap, p);
+    }
+
+    _sm_allocator_destroy(heap);
+}
+
+void LongLivedWorkerFunc(std::atomic<sm_allocator>* heap, std::atomic<int>* stage)
+{
+    for (int pass = 0; pass < 2; pass++)
+    {
+        // wait for the allocator of this pass
+        while (stage->load() != pass * 2 + 1)
+        {
+            std::this_thread::yield();
+        }
+
+        // thread cache is created on the first allocation and kept after the allocator is destroyed
+        sm_allocator space = heap->load();
+        std::vector<void*> ptrs;
+        for (size_t i = 0; i < 64; i++)
+        {
+            ptrs.push_back(_sm_malloc(space, 16, 16));
+            EXPECT_EQ(_sm_mbucket(space, ptrs.back()), 0);
+        }
+        for (void* p : ptrs)
+        {
+            _sm_free(space, p);
+        }
+        stage->fetch_add(1);
+    }
+
+    // exit with the cache of the destroyed allocator
+    while (stage->load() != 5)
+    {
+        std::this_thread::yield();
+    }
+}
+
+TEST(MultithreadingTests, ThreadOutlivesAllocator)
+{
+    std::atomic<sm_allocator> heap(nullptr);
+    std::atomic<int> stage(0);
+    std::thread worker(LongLivedWorkerFunc, &heap, &stage);
+
+    // the second allocator reuses the cache id of the first one, the worker still has a cache of the destroyed allocator
+    for (int pass = 0; pass < 2; pass++)
+    {
+        sm_allocator space = _sm_allocator_create(1, (64 * 1024));
+        _sm_allocator_thread_cache_auto(space, sm::CACHE_WARM, {256});
+        heap.store(space);
+        stage.store(pass * 2 + 1);
+        while (stage.load() != pass * 2 + 2)
+        {
+            std::this_thread::yield();
+        }
+        _sm_allocator_destroy(space);
+    }
+
+    stage.store(5);
+    worker.join();
+}
+
+void WorkerFunc(sm_allocator heap, std::atomic<int>* stage, bool flushBeforeSleep)
+{
+    _sm_allocator_thread_cache_create(heap, sm::CACHE_COLD, {8192, 16});
+
+    // park the whole bucket in the thread cache
+    std::vector<void*> ptrs;
+    size_t elementsCount = heap->GetBucketElementsCount(0);
+    for (size_t i = 0; i < elementsCount; i++)
+    {
+        ptrs.push_back(_sm_malloc(heap, 16, 16));
+    }
+    for (void* p : ptrs)
+    {
+        _sm_free(heap, p);
+    }
+
+    if (flushBeforeSleep)
+    {
+        _sm_allocator_thread_cache_flush(heap);
+    }
+
+    // sleep until scavenge is requested
+    stage->store(1);
+    while (stage->load() != 2)
+    {
+        std::this_thread::yield();
+    }
+
+    // any thread cache slow path (cache miss of another bucket here) handles the request
+    void* p = _sm_malloc(heap, 32, 16);
+    _sm_free(heap, p);
+
+    stage->store(3);
+    while (stage->load() != 4)
+    {
+        std::this_thread::yield();
+    }
+    _sm_allocator_thread_cache_destroy(heap);
+}
+
+static size_t CountBucketAllocations(sm_allocator heap, size_t elementsCount)
+{
+    std::vector<void*> ptrs;
+    size_t count = 0;
+    for (size_t i = 0; i < elementsCount; i++)
+    {
+        void* p = _sm_malloc(heap, 16, 16);
+        count += (_sm_mbucket(heap, p) == 0) ? 1 : 0;
+        ptrs.push_back(p);
+    }
+    for (void* p : ptrs)
+    {
+        _sm_free(heap, p);
+    }
+    return count;
+}
+
+TEST(MultithreadingTests, Scavenge)
+{
+    for (bool flushBeforeSleep : {false, true})
+    {
+        sm_allocator heap = _sm_allocator_create(2, (64 * 1024));
+        size_t elementsCount = heap->GetBucketElementsCount(0);
+
+        std::atomic<int> stage(0);
+        std::thread worker(WorkerFunc, heap, &stage, flushBeforeSleep);
+        while (stage.load() != 1)
+        {
+            std::this_thread::yield();
+        }
+
+        // elements parked in the sleeping thread cache are not available to other threads
+        EXPECT_EQ(CountBucketAllocations(heap, elementsCount), flushBeforeSleep ? elementsCount : size_t(0));
+
+        _sm_allocator_scavenge(heap);
+        stage.store(2);
+        while (stage.load() != 3)
+        {
+            std::this_thread::yield();
+        }
+
+        EXPECT_EQ(CountBucketAllocations(heap, elementsCount), elementsCount);
+
+        stage.store(4);
+        worker.join();
+        _sm_allocator_destroy(heap);
+    }
+}
+
+void StealVictimFunc(sm_allocator heap, std::atomic<int>* stage)
+{
+    _sm_allocator_thread_cache_create(heap, sm::CACHE_COLD, {1024, 16});
+
+    // park part of the bucket in the thread cache (the overflows publish stealable ranges)
+    std::vector<void*> ptrs;
+    size_t elementsCount = heap->GetBucketElementsCount(0);
+    for (size_t i = 0; i < elementsCount; i++)
+    {
+        ptrs.push_back(_sm_malloc(heap, 16, 16));
+    }
+    for (void* p : ptrs)
+    {
+        _sm_free(heap, p);
+    }
+
+    stage->store(1);
+    while (stage->load() != 2)
+    {
+        std::this_thread::yield();
+    }
+    _sm_allocator_thread_cache_destroy(heap);
+}
+
+TEST(MultithreadingTests, CacheStealing)
+{
+    size_t bucketAllocations[3];
+    for (int mode = 0; mode < 3; mode++)
+    {
+        // no stealing / thief without a cache / thief with a cache
+        sm_allocator heap = _sm_allocator_create(2, (64 * 1024), (mode != 0) ? sm::ALLOCATOR_CACHE_STEALING : sm::ALLOCATOR_DEFAULT);
+        size_t elementsCount = heap->GetBucketElementsCount(0);
+        if (mode == 2)
+        {
+            _sm_allocator_thread_cache_create(heap, sm::CACHE_COLD, {64, 16});
+        }
+
+        std::atomic<int> stage(0);
+        std::thread victim(StealVictimFunc, heap, &stage);
+        while (stage.load() != 1)
+        {
+            std::this_thread::yield();
+        }
+
+        bucketAllocations[mode] = CountBucketAllocations(heap, elementsCount);
+
+        stage.store(2);
+        victim.join();
+
+        // destroyed cache returns everything
+        EXPECT_EQ(CountBucketAllocations(heap, elementsCount), elementsCount);
+
+        _sm_allocator_thread_cache_destroy(heap);
+        _sm_allocator_destroy(heap);
+    }
+
+    // elements published by the sleeping thread are taken instead of falling back to the generic allocator
+    EXPECT_GT(bucketAllocations[1], bucketAllocations[0]);
+    EXPECT_GT(bucketAllocations[2], bucketAllocations[0]);
+}
+
+void StealStressFunc(sm_allocator heap, uint8_t threadIndex)
+{
+    _sm_allocator_thread_cache_create(heap, sm::CACHE_COLD, {256, 16});
+
+    // every thread wants more than its share of the bucket, stealing and publishing happen concurrently
+    size_t elementsCount = heap->GetBucketElementsCount(0) / 2;
+    std::vector<void*> ptrs;
+    for (int pass = 0; pass < 200; pass++)
+    {
+        for (size_t i = 0; i < elementsCount; i++)
+        {
+            void* p = _sm_malloc(heap, 16, 16);
+            std::memset(p, threadIndex, 16);
+            ptrs.push_back(p);
+        }
+        for (void* p : ptrs)
+        {
+            const uint8_t* bytes = (const uint8_t*)p;
+            for (size_t j = 0; j < 16; j++)
+            {
+                ASSERT_EQ(bytes[j], threadIndex);
+            }
+            _sm_free(heap, p);
+        }
+        ptrs.clear();
+    }
+
+    _sm_allocator_thread_cache_destroy(heap);
+}
+
+TEST(MultithreadingTests, CacheStealingStress)
+{
+    sm_allocator heap = _sm_allocator_create(2, (64 * 1024), sm::ALLOCATOR_CACHE_STEALING);
+
+    std::vector<std::thread> threads;
+    for (uint8_t i = 0; i < 4; i++)
+    {
+        threads.push_back(std::thread(StealStressFunc, heap, i));
+    }
+    for (auto& t : threads)
+    {
+        t.join();
+    }
+
+    // no element is lost or duplicated
+    size_t elementsCount = heap->GetBucketElementsCount(0);
+    EXPECT_EQ(CountBucketAllocations(heap, elementsCount + 1), elementsCount);
+
+    _sm_allocator_destroy(heap);
+}
+
+void JobFunc(sm_allocator heap, sm_thread_cache cache, std::vector<void*>* ptrs)
+{
+    // frees blocks allocated by the previous job (on another thread) and allocates new ones, the cache follows the job
+    for (void* p : *ptrs)
+    {
+        _sm_free_cache(heap, cache, p);
+    }
+    ptrs->clear();
+    for (size_t i = 0; i < 5000; i++)
+    {
+        ptrs->push_back(_sm_malloc_cache(heap, cache, 16 + (i % 48), 16));
+    }
+}
+
+TEST(MultithreadingTests, ExplicitThreadCacheMigration)
+{
+    sm_allocator heap = _sm_allocator_create(4, (4 * 1024 * 1024), sm::ALLOCATOR_CACHE_STEALING);
+    std::array<sm_thread_cache, 2> caches;
+    std::array<std::vector<void*>, 2> ptrs;
+    for (sm_thread_cache& cache : caches)
+    {
+        cache = _sm_thread_cache_create(heap, sm::CACHE_COLD, {256, 256, 256, 256});
+    }
+
+    // every job runs on a new thread, caches are used by one thread at a time
+    for (int pass = 0; pass < 20; pass++)
+    {
+        std::thread t0(JobFunc, heap, caches[0], &ptrs[0]);
+        std::thread t1(JobFunc, heap, caches[1], &ptrs[1]);
+        t0.join();
+        t1.join();
+    }
+
+    for (size_t i = 0; i < caches.size(); i++)
+    {
+        for (void* p : ptrs[i])
+        {
+            EXPECT_TRUE(heap->IsMyAlloc(p));
+            _sm_free_cache(heap, caches[i], p);
+        }
+        _sm_thread_cache_destroy(heap, caches[i]);
+    }
+
+    // nothing is lost
+    size_t elementsCount = heap->GetBucketElementsCount(0);
+    EXPECT_EQ(CountBucketAllocations(heap, elementsCount + 1), elementsCount);
+
+    _sm_allocator_destroy(heap);
 }